@@ -1,4 +1,9 @@
 %INTERFACE <UDPdiag>
+/* Every packet carries the 212-byte UDPdiag_packet header with
+ * the echoed statistics, plus any remote command bytes. Packet
+ * and alternate sizes below that are raised to it, so the
+ * smallest packet actually sent is 212 bytes.
+ */
 &command
   : Local set packet size %d * {
       if_UDPdiag.Turf("S:%d\n", $5);
@@ -6,6 +11,42 @@
   : Local set packet rate %d * {
       if_UDPdiag.Turf("R:%d\n", $5);
     }
+  : Local set payload PRBS * {
+      if_UDPdiag.Turf("P:1\n");
+    }
+  : Local set payload Random * {
+      if_UDPdiag.Turf("P:0\n");
+    }
+  : Local set traffic model CBR * {
+      if_UDPdiag.Turf("M:0\n");
+    }
+  : Local set traffic model Poisson * {
+      if_UDPdiag.Turf("M:1\n");
+    }
+  : Local set traffic model OnOff * {
+      if_UDPdiag.Turf("M:2\n");
+    }
+  : Local set traffic model Trace * {
+      if_UDPdiag.Turf("M:3\n");
+    }
+  : Local set burst duty cycle %d percent * {
+      if_UDPdiag.Turf("D:%d\n", $6);
+    }
+  : Local set burst period %d msecs * {
+      if_UDPdiag.Turf("B:%d\n", $5);
+    }
+  : Local set alternate packet size %d * {
+      if_UDPdiag.Turf("Z:%d\n", $6);
+    }
+  : Local set alternate size fraction %d percent * {
+      if_UDPdiag.Turf("F:%d\n", $6);
+    }
+  : Local probe path MTU * {
+      if_UDPdiag.Turf("U:1\n");
+    }
+  : Local abort MTU probe * {
+      if_UDPdiag.Turf("U:0\n");
+    }
   : Local Quit * {
       if_UDPdiag.Turf("Q\n");
     }
@@ -15,6 +56,42 @@
   : Remote set packet rate %d * {
       if_UDPdiag.Turf("XR:%d\n", $5);
     }
+  : Remote set payload PRBS * {
+      if_UDPdiag.Turf("XP:1\n");
+    }
+  : Remote set payload Random * {
+      if_UDPdiag.Turf("XP:0\n");
+    }
+  : Remote set traffic model CBR * {
+      if_UDPdiag.Turf("XM:0\n");
+    }
+  : Remote set traffic model Poisson * {
+      if_UDPdiag.Turf("XM:1\n");
+    }
+  : Remote set traffic model OnOff * {
+      if_UDPdiag.Turf("XM:2\n");
+    }
+  : Remote set traffic model Trace * {
+      if_UDPdiag.Turf("XM:3\n");
+    }
+  : Remote set burst duty cycle %d percent * {
+      if_UDPdiag.Turf("XD:%d\n", $6);
+    }
+  : Remote set burst period %d msecs * {
+      if_UDPdiag.Turf("XB:%d\n", $5);
+    }
+  : Remote set alternate packet size %d * {
+      if_UDPdiag.Turf("XZ:%d\n", $6);
+    }
+  : Remote set alternate size fraction %d percent * {
+      if_UDPdiag.Turf("XF:%d\n", $6);
+    }
+  : Remote probe path MTU * {
+      if_UDPdiag.Turf("XU:1\n");
+    }
+  : Remote abort MTU probe * {
+      if_UDPdiag.Turf("XU:0\n");
+    }
   : Remote Quit * {
       if_UDPdiag.Turf("XQ\n");
     }
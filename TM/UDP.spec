@@ -1,4 +1,5 @@
 tmcbase = base.tmc
+tmcbase = timing.tmc
 tmcbase = /usr/local/share/linkeng/flttime.tmc
 colbase = UDPdiag_col.tmc
 cmdbase = UDP.cmd
@@ -14,6 +15,6 @@ IDISTRIB = interact_local.sh interact_remote.sh
 UDPcol :
 # UDPsrvr :
 # UDPclt :
-UDPdisp : display.tbl
+UDPdisp : ber.tmc loss.tmc totals.tmc display.tbl
 %%
 CXXFLAGS=-g
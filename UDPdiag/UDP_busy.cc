@@ -0,0 +1,132 @@
+/** @file UDP_busy.cc */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "UDP_busy.h"
+#include "nl.h"
+
+UDP_busy_rx::UDP_busy_rx(int sock, int bufsize, int cpu)
+    : head(0),
+      tail(0),
+      sock(sock),
+      bufsize(bufsize),
+      cpu(cpu),
+      stop(false),
+      errors(0),
+      last_errno(0),
+      errors_reported(0)
+{
+  uint8_t *pool = (uint8_t *)malloc((size_t)ring_size * bufsize);
+  if (pool == 0)
+    msg(MSG_FATAL, "Out of memory for %u busy-poll slots", ring_size);
+  for (uint32_t i = 0; i < ring_size; ++i)
+    ring[i].buf = pool + (size_t)i * bufsize;
+  if (pipe(pipe_fds) || fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK) ||
+      fcntl(pipe_fds[1], F_SETFL, O_NONBLOCK))
+    msg(MSG_FATAL, "Unable to create busy-poll notify pipe: %s",
+        strerror(errno));
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+#ifdef CPU_SET
+  cpu_set_t cpus;
+  if (cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    if (err)
+      msg(MSG_FATAL, "Unable to pin busy-poll thread to CPU %d: %s",
+          cpu, strerror(err));
+  }
+#endif
+  int err = pthread_create(&thread, &attr, thread_main, this);
+  pthread_attr_destroy(&attr);
+  if (err)
+    msg(MSG_FATAL, "Unable to start busy-poll thread: %s", strerror(err));
+#ifdef CPU_SET
+  if (cpu >= 0) {
+    cpu_set_t actual;
+    if (pthread_getaffinity_np(thread, sizeof(actual), &actual) ||
+        !CPU_EQUAL(&actual, &cpus))
+      msg(MSG_FATAL, "Busy-poll thread is not pinned to CPU %d", cpu);
+  }
+#endif
+}
+
+/**
+ * The notify pipe's read end belongs to the receiver's
+ * interface, which closes it.
+ */
+UDP_busy_rx::~UDP_busy_rx() {
+  __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+  pthread_join(thread, 0);
+  close(pipe_fds[1]);
+  free(ring[0].buf);
+}
+
+void *UDP_busy_rx::thread_main(void *arg) {
+  ((UDP_busy_rx *)arg)->run();
+  return 0;
+}
+
+void UDP_busy_rx::run() {
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= ring_size)
+      continue; // ring full, the socket buffer holds the rest
+    UDP_busy_slot *slot = &ring[head % ring_size];
+    int n = recv(sock, slot->buf, bufsize-1, MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        count_error(errno);
+      continue;
+    }
+    clock_gettime(CLOCK_REALTIME, &slot->rx_time);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    slot->rx_mono_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    slot->len = n;
+    slot->overhead_usecs = -1;
+#ifdef SIOCGSTAMPNS
+    struct timespec kts;
+    if (ioctl(sock, SIOCGSTAMPNS, &kts) == 0) {
+      int64_t usecs = (slot->rx_time.tv_sec - kts.tv_sec) * 1000000LL +
+                      (slot->rx_time.tv_nsec - kts.tv_nsec) / 1000;
+      if (usecs >= 0) slot->overhead_usecs = usecs;
+    }
+#endif
+    // The loop checks head after advancing tail, and we check tail
+    // after advancing head, so one of us sees the other's update.
+    __atomic_store_n(&head, head+1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tail, __ATOMIC_SEQ_CST) == head-1) {
+      char c = 0;
+      if (write(pipe_fds[1], &c, 1) < 0 && errno != EAGAIN)
+        count_error(errno);
+    }
+  }
+}
+
+UDP_busy_slot *UDP_busy_rx::next() {
+  if (__atomic_load_n(&head, __ATOMIC_SEQ_CST) == tail) return 0;
+  return &ring[tail % ring_size];
+}
+
+void UDP_busy_rx::release() {
+  __atomic_store_n(&tail, tail+1, __ATOMIC_SEQ_CST);
+}
+
+void UDP_busy_rx::report_errors(const char *iname) {
+  uint32_t n = __atomic_load_n(&errors, __ATOMIC_ACQUIRE);
+  if (n == errors_reported) return;
+  int err = __atomic_load_n(&last_errno, __ATOMIC_RELAXED);
+  msg(MSG_ERROR, "%s: %u busy-poll receive errors, last errno %d: %s",
+      iname, n - errors_reported, err, strerror(err));
+  errors_reported = n;
+}
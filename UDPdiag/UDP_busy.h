@@ -0,0 +1,66 @@
+#ifndef UDP_BUSY_H_INCLUDED
+#define UDP_BUSY_H_INCLUDED
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+  int len;
+  /** CLOCK_REALTIME and CLOCK_MONOTONIC when the packet was read */
+  struct timespec rx_time;
+  uint64_t rx_mono_ns;
+  /** usecs from the kernel's receive timestamp, or -1 */
+  int32_t overhead_usecs;
+  uint8_t *buf;
+} UDP_busy_slot;
+
+/**
+ * Busy-poll receive thread for UDP_receiver's -b mode. The
+ * thread spins on a non-blocking recv() of the socket, pinned
+ * to a CPU if requested, and timestamps each packet as soon as
+ * it is read. Packets are handed to the event loop through a
+ * single-producer, single-consumer ring of preallocated slots.
+ * One byte is written to the notify pipe only when the ring
+ * goes from empty to non-empty, so a burst costs the loop one
+ * wakeup, and the loop's wakeup latency does not affect the
+ * receive timestamps. The thread never calls msg(). It is pinned
+ * before it starts, and its errors are counted for the loop to
+ * report with report_errors().
+ */
+class UDP_busy_rx {
+  public:
+    UDP_busy_rx(int sock, int bufsize, int cpu);
+    ~UDP_busy_rx();
+    /** The read end of the notify pipe, for the event loop */
+    inline int notify_fd() { return pipe_fds[0]; }
+    /** @return The oldest packet not yet processed, or 0 */
+    UDP_busy_slot *next();
+    /** Return the slot from next() to the thread */
+    void release();
+    /** Log any errors the thread has counted since the last call */
+    void report_errors(const char *iname);
+  protected:
+    static void *thread_main(void *arg);
+    void run();
+    inline void count_error(int err) {
+      __atomic_store_n(&last_errno, err, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&errors, 1, __ATOMIC_RELEASE);
+    }
+    static const uint32_t ring_size = 64;
+    UDP_busy_slot ring[ring_size];
+    /** Written only by the thread and the loop respectively */
+    uint32_t head, tail;
+    int sock;
+    int bufsize;
+    int cpu;
+    int pipe_fds[2];
+    bool stop;
+    /** recv and notify errors, written by the thread */
+    uint32_t errors;
+    int last_errno;
+    /** errors already reported by the loop */
+    uint32_t errors_reported;
+    pthread_t thread;
+};
+
+#endif
@@ -0,0 +1,175 @@
+/** @file UDP_impair.cc */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "UDP_impair.h"
+#include "nl.h"
+
+const char *impair_spec;
+
+UDP_impair::UDP_impair(const char *spec, int max_packet_size)
+    : n_held(0),
+      max_packet_size(max_packet_size),
+      ge_bad(false),
+      n_submitted(0),
+      n_dropped(0),
+      n_duplicated(0),
+      n_reordered(0),
+      n_corrupted(0),
+      n_overflow(0)
+{
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.queue = 256;
+  cfg.seed = 1;
+  parse(spec);
+  xsubi[0] = 0x330E;
+  xsubi[1] = cfg.seed & 0xFFFF;
+  xsubi[2] = (cfg.seed >> 16) & 0xFFFF;
+  slots = (UDP_impair_slot *)calloc(cfg.queue, sizeof(UDP_impair_slot));
+  uint8_t *pool = (uint8_t *)malloc((size_t)cfg.queue * max_packet_size);
+  if (slots == 0 || pool == 0)
+    msg(MSG_FATAL, "Out of memory for %d impairment slots", cfg.queue);
+  for (int i = 0; i < cfg.queue; ++i)
+    slots[i].buf = pool + (size_t)i * max_packet_size;
+  msg(MSG, "Impairing transmit path: %s", spec);
+}
+
+UDP_impair::~UDP_impair() {
+  report();
+  if (slots) {
+    free(slots[0].buf);
+    free(slots);
+  }
+}
+
+void UDP_impair::parse(const char *spec) {
+  char *copy = strdup(spec);
+  char *save;
+  for (char *tok = strtok_r(copy, ",", &save); tok;
+       tok = strtok_r(0, ",", &save)) {
+    int n = 0;
+    if (sscanf(tok, "loss=%lf%n", &cfg.loss, &n) == 1 ||
+        sscanf(tok, "ge=%lf/%lf/%lf%n", &cfg.ge_p, &cfg.ge_r,
+                                          &cfg.ge_loss, &n) == 3 ||
+        sscanf(tok, "delay=%d%n", &cfg.delay_msecs, &n) == 1 ||
+        sscanf(tok, "jitter=%d%n", &cfg.jitter_msecs, &n) == 1 ||
+        sscanf(tok, "reorder=%lf/%d%n", &cfg.reorder,
+                                         &cfg.reorder_msecs, &n) == 2 ||
+        sscanf(tok, "dup=%lf%n", &cfg.dup, &n) == 1 ||
+        sscanf(tok, "ber=%lf%n", &cfg.ber, &n) == 1 ||
+        sscanf(tok, "queue=%d%n", &cfg.queue, &n) == 1 ||
+        sscanf(tok, "seed=%u%n", &cfg.seed, &n) == 1) {
+      if (tok[n] == '\0') continue;
+    }
+    msg(MSG_FATAL, "Invalid impairment setting '%s'", tok);
+  }
+  free(copy);
+  if (cfg.queue < 1)
+    msg(MSG_FATAL, "Impairment queue must hold at least one packet");
+  if (cfg.jitter_msecs > cfg.delay_msecs)
+    msg(MSG_WARN, "Impairment jitter exceeds delay, clipping at zero");
+}
+
+double UDP_impair::uniform() {
+  return erand48(xsubi);
+}
+
+void UDP_impair::submit(const uint8_t *pkt, int len, uint64_t now_ns) {
+  ++n_submitted;
+  double p_loss = cfg.loss;
+  if (cfg.ge_p > 0) {
+    if (ge_bad) {
+      if (uniform() < cfg.ge_r) ge_bad = false;
+    } else if (uniform() < cfg.ge_p) ge_bad = true;
+    if (ge_bad) p_loss = cfg.ge_loss;
+  }
+  if (p_loss > 0 && uniform() < p_loss) {
+    ++n_dropped;
+    return;
+  }
+  enqueue(pkt, len, now_ns);
+  if (cfg.dup > 0 && uniform() < cfg.dup) {
+    ++n_duplicated;
+    enqueue(pkt, len, now_ns);
+  }
+}
+
+void UDP_impair::enqueue(const uint8_t *pkt, int len, uint64_t now_ns) {
+  if (n_held >= cfg.queue || len > max_packet_size) {
+    ++n_overflow;
+    return;
+  }
+  int64_t delay = cfg.delay_msecs;
+  if (cfg.jitter_msecs)
+    delay += (int64_t)((2*uniform()-1) * cfg.jitter_msecs);
+  if (cfg.reorder > 0 && uniform() < cfg.reorder) {
+    ++n_reordered;
+    delay += cfg.reorder_msecs;
+  }
+  if (delay < 0) delay = 0;
+  UDP_impair_slot *slot = slots;
+  while (slot->in_use) ++slot;
+  slot->in_use = true;
+  slot->len = len;
+  slot->release_ns = now_ns + delay * 1000000;
+  memcpy(slot->buf, pkt, len);
+  if (cfg.ber > 0) corrupt(slot->buf, len);
+  ++n_held;
+}
+
+/**
+ * Flip bits at geometrically distributed intervals, which is
+ * equivalent to flipping each bit independently with
+ * probability ber.
+ */
+void UDP_impair::corrupt(uint8_t *buf, int len) {
+  uint64_t nbits = (uint64_t)len * 8;
+  double scale = cfg.ber < 1 ? 1/log(1-cfg.ber) : 0;
+  bool hit = false;
+  for (uint64_t pos = (uint64_t)(log(1-uniform()) * scale);
+       pos < nbits;
+       pos += 1 + (uint64_t)(log(1-uniform()) * scale)) {
+    buf[pos/8] ^= 0x80 >> (pos%8);
+    hit = true;
+  }
+  if (hit) ++n_corrupted;
+}
+
+/** @return The held packet with the earliest release time at or before now_ns */
+UDP_impair_slot *UDP_impair::next_due(uint64_t now_ns) {
+  UDP_impair_slot *due = 0;
+  for (int i = 0, n = 0; n < n_held; ++i) {
+    if (!slots[i].in_use) continue;
+    ++n;
+    if (slots[i].release_ns <= now_ns &&
+        (due == 0 || slots[i].release_ns < due->release_ns))
+      due = &slots[i];
+  }
+  return due;
+}
+
+void UDP_impair::release(UDP_impair_slot *slot) {
+  slot->in_use = false;
+  --n_held;
+}
+
+int UDP_impair::msecs_until_due(uint64_t now_ns) {
+  uint64_t next = 0;
+  for (int i = 0, n = 0; n < n_held; ++i) {
+    if (!slots[i].in_use) continue;
+    ++n;
+    if (next == 0 || slots[i].release_ns < next)
+      next = slots[i].release_ns;
+  }
+  if (n_held == 0) return -1;
+  return next <= now_ns ? 0 : (next - now_ns + 999999)/1000000;
+}
+
+void UDP_impair::report() {
+  msg(MSG, "Impairment: %" PRIu64 " packets, %" PRIu64 " dropped, "
+    "%" PRIu64 " duplicated, %" PRIu64 " reordered, %" PRIu64 " corrupted, "
+    "%" PRIu64 " queue overflows", n_submitted, n_dropped, n_duplicated,
+    n_reordered, n_corrupted, n_overflow);
+}
@@ -0,0 +1,79 @@
+#ifndef UDP_IMPAIR_H_INCLUDED
+#define UDP_IMPAIR_H_INCLUDED
+#include <stdint.h>
+
+extern const char *impair_spec;
+
+/**
+ * Link impairment parameters, parsed from the -I option as a
+ * comma-separated list of name=value settings:
+ *   loss=<p>           Bernoulli loss probability
+ *   ge=<p>/<r>/<loss>  Gilbert-Elliott good->bad and bad->good
+ *                      transition probabilities and the loss
+ *                      probability in the bad state
+ *   delay=<msecs>      Fixed delay
+ *   jitter=<msecs>     Uniform delay variation of +/- msecs
+ *   reorder=<p>/<msecs> Probability a packet is held back an
+ *                      extra msecs so later packets pass it
+ *   dup=<p>            Duplication probability
+ *   ber=<p>            Bit error rate
+ *   queue=<n>          Maximum packets held for delay
+ *   seed=<n>           Random seed
+ */
+typedef struct {
+  double loss;
+  double ge_p;
+  double ge_r;
+  double ge_loss;
+  int delay_msecs;
+  int jitter_msecs;
+  double reorder;
+  int reorder_msecs;
+  double dup;
+  double ber;
+  int queue;
+  unsigned seed;
+} UDP_impair_cfg;
+
+typedef struct {
+  uint64_t release_ns;
+  int len;
+  bool in_use;
+  uint8_t *buf;
+} UDP_impair_slot;
+
+/**
+ * An in-process link impairment shim between UDP_transmitter
+ * and its socket. Each packet submitted is dropped, or copied
+ * (once, or twice if duplicated) into a preallocated slot with
+ * its release time, possibly with bits flipped. The transmitter
+ * writes slots out as they come due. All random choices come
+ * from a single seeded generator, so a given seed and packet
+ * sequence always produce the same impairments.
+ */
+class UDP_impair {
+  public:
+    UDP_impair(const char *spec, int max_packet_size);
+    ~UDP_impair();
+    void submit(const uint8_t *pkt, int len, uint64_t now_ns);
+    UDP_impair_slot *next_due(uint64_t now_ns);
+    void release(UDP_impair_slot *slot);
+    /** @return msecs until the next release or -1 if none are held */
+    int msecs_until_due(uint64_t now_ns);
+    void report();
+  protected:
+    void parse(const char *spec);
+    double uniform();
+    void enqueue(const uint8_t *pkt, int len, uint64_t now_ns);
+    void corrupt(uint8_t *buf, int len);
+    UDP_impair_cfg cfg;
+    UDP_impair_slot *slots;
+    int n_held;
+    int max_packet_size;
+    bool ge_bad;
+    unsigned short xsubi[3];
+    uint64_t n_submitted, n_dropped, n_duplicated, n_reordered;
+    uint64_t n_corrupted, n_overflow;
+};
+
+#endif
@@ -5,22 +5,45 @@
 #include "dasio/client.h"
 #include "dasio/tm_tmr.h"
 #include "UDPdiag.h"
+#include "UDP_traffic.h"
+#include "UDP_impair.h"
+#include "UDP_shm.h"
+#include "UDP_busy.h"
 
 extern bool allow_remote_commands;
 extern const char *remote_ip, *rx_port, *tx_port;
+extern const char *shm_name;
+/** The largest packet we transmit, from -M. It is at least
+ *  large enough for the header and the longest command. */
+extern int max_packet_size;
+extern bool busy_poll;
+extern int busy_poll_cpu;
+extern UDP_shm_t *UDPdiag_shm;
 void UDPdiag_init_options(int argc, char **argv);
 
+/** The largest UDP payload over IPv4. Packet_size and the other
+ *  size fields remain 16 bits, which is enough to hold it. */
+#define UDP_MAX_PACKET_SIZE 65507
+/** The most remote command bytes a packet carries */
+#define UDP_MAX_COMMAND_BYTES 16
+
+/** Payload_mode values */
+#define UDP_PAYLOAD_RANDOM 0
+#define UDP_PAYLOAD_PRBS31 1
+
 typedef struct __attribute__((packed)) {
   uint16_t Command_bytes;
   /** Requested size of packet, in bytes */
   uint16_t Packet_size;
   uint16_t Packet_rate;
+  /** Padding is rand() bytes or PRBS-31 seeded from Transmit_SN */
+  uint16_t Payload_mode;
   /** Number of packets transmitted during last second */
-  uint16_t Int_packets_tx;
+  uint32_t Int_packets_tx;
   /** The SN of this packet */
-  uint32_t Transmit_SN;
+  uint64_t Transmit_SN;
   /** The SN of the last packet received */
-  uint32_t Receive_SN;
+  uint64_t Receive_SN;
   /** msecs since midnight utc */
   int32_t  Transmit_timestamp;
   /** Number of packets received during last second */
@@ -32,13 +55,49 @@ typedef struct __attribute__((packed)) {
   /** Maximum receive latency during last second */
   uint32_t Int_max_latency;
   /** Total bytes received during last second */
-  uint32_t Int_bytes_rx;
+  uint64_t Int_bytes_rx;
   /** Interval bytes transmitted during last second */
-  uint32_t Int_bytes_tx;
+  uint64_t Int_bytes_tx;
   /** Total valid packets received */
-  uint32_t Total_valid_packets_rx;
+  uint64_t Total_valid_packets_rx;
   /** Total invalid packets received */
-  uint32_t Total_invalid_packets_rx;
+  uint64_t Total_invalid_packets_rx;
+  /** PRBS payload bits received during last second */
+  uint64_t Int_bits_checked;
+  /** Flipped PRBS payload bits during last second */
+  uint64_t Int_bit_errors;
+  /** Error bursts during last second */
+  uint32_t Int_error_bursts;
+  /** Longest error burst in bits during last second */
+  uint32_t Int_max_burst;
+  /** Errored packets by number of flipped bits during last second */
+  uint32_t Errored_hist[UDP_ERR_HIST_BINS];
+  /** Mean and max usecs from kernel receive to processing */
+  uint32_t Int_rx_overhead_mean;
+  uint32_t Int_rx_overhead_max;
+  /** The sender's interval number when this packet was sent */
+  uint32_t Tx_interval;
+  /** The sender's interval covered by the Int_ statistics above
+   *  and msecs since midnight utc when it ended */
+  uint32_t Int_interval;
+  int32_t  Int_timestamp;
+  /** Exact counts for the sender's last matched interval of
+   *  the reverse direction */
+  uint32_t Match_interval;
+  uint32_t Match_packets_tx;
+  uint32_t Match_packets_rx;
+  /** The sender's CLOCK_MONOTONIC usecs when this packet was sent */
+  uint32_t Transmit_usecs;
+  /** Arrival statistics during last second */
+  uint32_t Int_jitter;
+  uint32_t Int_iat_min;
+  uint32_t Int_iat_mean;
+  uint32_t Int_iat_max;
+  uint32_t Int_arrival_rate;
+  uint32_t Iat_hist[UDP_IAT_HIST_BINS];
+  /** Incremented for each new remote command, so the receiver
+   *  executes a command only once though every packet repeats it */
+  uint16_t Command_seq;
   uint8_t  Remainder[2];
   // All the padding and commands go in before the CRC
 } UDPdiag_packet;
@@ -50,6 +109,8 @@ class UDP_interface : public DAS_IO::Interface {
   protected:
     uint16_t crc_calc(uint8_t *buf, int len);
     int32_t get_timestamp();
+    int32_t get_timestamp(const struct timespec *ts);
+    uint64_t get_monotonic_ns();
 };
 
 class UDP_tmr;
@@ -59,22 +120,86 @@ class UDP_transmitter : public UDP_interface {
   public:
     UDP_transmitter(const char *rmt_ip, const char *rmt_port,
       UDP_tmr *tmr);
+    ~UDP_transmitter();
     bool parse_command(char *cmd, unsigned cmdlen);
     bool transmit(uint16_t n_pkts);
     bool tm_sync_too();
+    void shm_live();
   protected:
+    bool protocol_timeout();
+    bool impair_flush();
+    void build_packet(uint16_t size);
+    bool send_packet(uint16_t size);
+    bool transmit_scheduled();
+    void set_timer();
+    void set_traffic_model(uint16_t model);
+    void mtu_probe_start();
+    void mtu_probe_stop(uint16_t state);
+    void mtu_probe_step();
+    int get_path_mtu(int sock);
+    void mtu_sweep_start(int path_mtu);
+    void mtu_collect();
+    /** The smallest MTU that holds a packet with a command */
+    inline int mtu_min() {
+      return 28 + sizeof(UDPdiag_packet) + sizeof(L2R_command);
+    }
     void crc_set();
+    void pad_fill();
     UDPdiag_packet *pkt;
     uint32_t L2R_Int_packets_tx;
-    uint32_t L2R_Int_bytes_tx;
+    uint64_t L2R_Int_bytes_tx;
     uint32_t Int_packets_tx;
-    uint32_t Int_bytes_tx;
-    uint32_t L2R_Transmit_SN;
+    uint64_t Int_bytes_tx;
+    uint64_t L2R_Transmit_SN;
+    /** The current interval, tagged on each packet */
+    uint32_t L2R_Interval;
     uint16_t L2R_Packet_size;
     uint16_t L2R_Packet_rate;
+    uint16_t L2R_Payload_mode;
+    uint16_t L2R_Traffic_model;
     uint8_t L2R_command_len;
-    uint8_t L2R_command[8];
-    static const int max_packet_size = 8000;
+    uint16_t L2R_command_seq;
+    uint8_t L2R_command[UDP_MAX_COMMAND_BYTES];
+    UDP_traffic_cfg traffic_cfg;
+    /** 0 for constant bit rate */
+    UDP_traffic *traffic;
+    /** CLOCK_MONOTONIC nsecs when the next modeled packet is due */
+    uint64_t next_departure;
+    uint16_t next_size;
+    /** Path MTU probe state */
+    static const int mtu_max_steps = 16;
+    /** Intervals at each size, the first mtu_settle discarded
+     *  for latency, and the most to wait for the last counts */
+    static const int mtu_dwell = 4;
+    static const int mtu_settle = 2;
+    static const int mtu_drain = 8;
+    /** DF packets sent for each discovery trial */
+    static const int mtu_probes = 4;
+    uint16_t mtu_sizes[mtu_max_steps];
+    int mtu_n_sizes;
+    int mtu_step;
+    int mtu_interval;
+    /** The DF socket during discovery, otherwise -1 */
+    int mtu_fd;
+    /** fd's saved IP_MTU_DISCOVER setting during the sweep */
+    int mtu_pmtudisc;
+    uint16_t mtu_saved_size;
+    /** Discovery bounds: the largest MTU confirmed and the
+     *  largest not yet ruled out */
+    int mtu_lo, mtu_hi;
+    /** The MTU on trial, or 0, its interval and DF packets sent */
+    int mtu_trial_mtu;
+    uint32_t mtu_trial;
+    int mtu_trial_sent;
+    /** The first interval sent at each size, and the end */
+    uint32_t mtu_step_start[mtu_max_steps+1];
+    /** The last L2R Matched_interval accounted */
+    uint32_t mtu_matched;
+    uint64_t mtu_step_tx[mtu_max_steps], mtu_step_rx[mtu_max_steps];
+    int64_t mtu_latency[2];
+    uint64_t mtu_latency_n[2];
+    /** 0 unless the -I option is given */
+    UDP_impair *impair;
     UDP_tmr *tmr;
     UDP_receiver *rx;
 };
@@ -82,22 +207,80 @@ class UDP_transmitter : public UDP_interface {
 class UDP_receiver : public UDP_interface {
   public:
     UDP_receiver(const char *port, bool allow_remote_commands, UDP_transmitter *tx);
+    ~UDP_receiver();
   protected:
     bool protocol_input();
+    bool process_packet(int32_t now, uint64_t now_ns);
+    bool busy_receive();
     bool tm_sync();
     bool crc_ok();
+    void prbs_check();
+    void match_record();
+    void match_finalize(uint32_t upto);
+    void arrival_stats(uint64_t now_ns);
+    void shm_live();
     const char *recv_port;
     bool allow_remote_commands;
     UDP_transmitter *tx;
     UDPdiag_packet *pkt;
-    uint32_t R2L_Total_packets_rx;
-    uint32_t R2L_Total_valid_packets_rx;
-    uint32_t R2L_Total_invalid_packets_rx;
+    uint64_t R2L_Total_packets_rx;
+    uint64_t R2L_Total_valid_packets_rx;
+    uint64_t R2L_Total_invalid_packets_rx;
     uint32_t R2L_Int_packets_rx;
     int32_t  R2L_Int_min_latency;
     int32_t  R2L_Int_max_latency;
-    uint32_t R2L_Int_bytes_rx;
-    int32_t  R2L_latencies;
+    uint64_t R2L_Int_bytes_rx;
+    int64_t  R2L_latencies;
+    uint64_t R2L_Int_bits_checked;
+    uint64_t R2L_Int_bit_errors;
+    uint32_t R2L_Int_error_bursts;
+    uint32_t R2L_Int_max_burst;
+    uint32_t R2L_Errored_hist[UDP_ERR_HIST_BINS];
+    uint32_t R2L_overhead_n;
+    uint64_t R2L_overhead_sum;
+    uint32_t R2L_overhead_max;
+    /** Command_seq of the last remote command executed */
+    bool rmt_command_seen;
+    uint16_t rmt_command_seq;
+    /** Receive counts by the sender's interval number. Records for
+     *  intervals match_next through match_next+match_ring_size-1
+     *  are kept until the sender's transmit count arrives and no
+     *  more of their packets are expected.
+     */
+    static const int match_ring_size = 8;
+    struct match_rec {
+      uint32_t interval;
+      uint32_t packets_rx;
+      uint32_t packets_tx;
+      bool tx_known;
+    } match_ring[match_ring_size];
+    bool match_started;
+    uint32_t match_next;
+    uint32_t match_max;
+    /** Matched counts accumulated since the last report, and the
+     *  last interval they include. All three are published
+     *  together at tm_sync. */
+    bool match_new;
+    uint32_t match_packets_tx;
+    uint32_t match_packets_rx;
+    uint32_t match_interval;
+    /** Arrival timing on CLOCK_MONOTONIC */
+    bool arrival_started;
+    uint64_t last_arrival_ns;
+    /** Arrival minus send usecs of the previous packet */
+    uint32_t last_transit;
+    /** RFC 3550 jitter estimate in usecs, scaled by 16 */
+    uint32_t jitter16;
+    uint32_t R2L_iat_n;
+    uint64_t R2L_iat_sum;
+    uint32_t R2L_iat_min;
+    uint32_t R2L_iat_max;
+    uint32_t R2L_Iat_hist[UDP_IAT_HIST_BINS];
+    uint64_t interval_start_ns;
+    /** The receive thread in busy-poll mode, otherwise 0 */
+    UDP_busy_rx *busy;
+    /** The UDP socket in busy-poll mode, when fd is the notify pipe */
+    int sock;
     // uint32_t L2R_Int_packets_tx;
 };
 
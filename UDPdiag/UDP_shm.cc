@@ -0,0 +1,132 @@
+/** @file UDP_shm.cc */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include "UDP_shm.h"
+
+/**
+ * Take over a segment left behind by a UDPdiag that did not
+ * exit cleanly. A segment whose writer is still running, or
+ * that does not belong to UDPdiag, is left alone.
+ * @return true if the name was unlinked and may be reused
+ */
+static bool UDP_shm_reclaim(const char *name) {
+  const UDP_shm_t *shm = UDP_shm_attach(name);
+  if (shm == 0) {
+    // Only an older UDPdiag layout is reclaimed
+    if (errno != EPROTO) return false;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    uint32_t magic = 0;
+    ssize_t n = read(fd, &magic, sizeof(magic));
+    close(fd);
+    if (n != sizeof(magic) || magic != UDP_SHM_MAGIC) {
+      errno = EEXIST;
+      return false;
+    }
+  } else {
+    bool alive = UDP_shm_writer_alive(shm);
+    munmap((void *)shm, sizeof(UDP_shm_t));
+    if (alive) {
+      errno = EBUSY;
+      return false;
+    }
+  }
+  return shm_unlink(name) == 0 || errno == ENOENT;
+}
+
+/**
+ * Create the named segment and initialize its header. A stale
+ * segment from an earlier UDPdiag is replaced, but a segment
+ * with a live writer is not shared.
+ * @return The mapped segment, or 0 with errno set on failure.
+ * errno is EBUSY if another UDPdiag is writing the segment.
+ */
+UDP_shm_t *UDP_shm_create(const char *name) {
+  int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+  if (fd < 0 && errno == EEXIST && UDP_shm_reclaim(name))
+    fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+  if (fd < 0) return 0;
+  if (ftruncate(fd, sizeof(UDP_shm_t))) {
+    int err = errno;
+    close(fd);
+    shm_unlink(name);
+    errno = err;
+    return 0;
+  }
+  void *mem = mmap(0, sizeof(UDP_shm_t), PROT_READ|PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    int err = errno;
+    shm_unlink(name);
+    errno = err;
+    return 0;
+  }
+  UDP_shm_t *shm = (UDP_shm_t *)mem;
+  // The new segment is zero-filled, so readers that attach
+  // before the header is complete fail the magic check.
+  __atomic_store_n(&shm->seq, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  shm->version = UDP_SHM_VERSION;
+  shm->reserved = 0;
+  shm->size = sizeof(UDP_shm_t);
+  shm->pid = getpid();
+  shm->interval = 0;
+  shm->publish_ns = 0;
+  __atomic_store_n(&shm->magic, UDP_SHM_MAGIC, __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->seq, 2, __ATOMIC_RELEASE);
+  return shm;
+}
+
+/**
+ * Mark the writer as gone for any attached readers, then unlink
+ * and unmap the segment.
+ */
+void UDP_shm_destroy(UDP_shm_t *shm, const char *name) {
+  UDP_shm_begin(shm);
+  shm->pid = 0;
+  UDP_shm_end(shm);
+  shm_unlink(name);
+  munmap(shm, sizeof(UDP_shm_t));
+}
+
+/**
+ * Map an existing segment read-only.
+ * @return The mapped segment, or 0 with errno set on failure.
+ * errno is EPROTO if the segment is not a compatible version.
+ */
+const UDP_shm_t *UDP_shm_attach(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(UDP_shm_t)) {
+    close(fd);
+    errno = EPROTO;
+    return 0;
+  }
+  void *mem = mmap(0, sizeof(UDP_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return 0;
+  const UDP_shm_t *shm = (const UDP_shm_t *)mem;
+  if (shm->magic != UDP_SHM_MAGIC || shm->version != UDP_SHM_VERSION ||
+      shm->size != sizeof(UDP_shm_t)) {
+    munmap(mem, sizeof(UDP_shm_t));
+    errno = EPROTO;
+    return 0;
+  }
+  return shm;
+}
+
+/**
+ * @return true if the process that created the segment is
+ * still running.
+ */
+bool UDP_shm_writer_alive(const UDP_shm_t *shm) {
+  pid_t pid = __atomic_load_n(&shm->pid, __ATOMIC_RELAXED);
+  if (pid <= 0) return false;
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
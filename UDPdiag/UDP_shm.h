@@ -0,0 +1,110 @@
+#ifndef UDP_SHM_H_INCLUDED
+#define UDP_SHM_H_INCLUDED
+#include <stdint.h>
+#include <string.h>
+#include "UDPdiag.h"
+
+/** Shared memory statistics export
+ * When the -m option is given, UDPdiag publishes into a POSIX
+ * shared memory segment a copy of its UDPdiag_t struct at the
+ * end of each interval, and live counters for the interval in
+ * progress and the running totals as each packet is sent or
+ * received. Readers take consistent snapshots with
+ * UDP_shm_read() at whatever rate they like without any
+ * syscalls or coordination with UDPdiag. UDP_SHM_VERSION must
+ * be incremented whenever the layout of UDPdiag_t or
+ * UDP_shm_live_t changes.
+ *
+ * Only one UDPdiag may write a segment. The writer's pid is kept
+ * in the header so a second instance refuses to take over a live
+ * segment, and readers can tell when the writer has gone away.
+ * The writer clears it and unlinks the segment when it exits.
+ */
+#define UDP_SHM_MAGIC 0x53504455 // "UDPS"
+#define UDP_SHM_VERSION 7
+#define UDP_SHM_DEFAULT_NAME "/UDPdiag"
+
+/** Counters as of the last packet sent or received */
+typedef struct {
+  /** The local interval in progress */
+  uint32_t Interval;
+  /** CLOCK_MONOTONIC nsecs when it started and at the last update */
+  uint64_t Interval_start_ns;
+  uint64_t Update_ns;
+  /** L2R transmit counts */
+  uint64_t Total_packets_tx;
+  uint32_t Int_packets_tx;
+  uint64_t Int_bytes_tx;
+  /** R2L receive counts */
+  uint64_t Total_valid_packets_rx;
+  uint64_t Total_invalid_packets_rx;
+  uint64_t Receive_SN;
+  uint32_t Int_packets_rx;
+  uint64_t Int_bytes_rx;
+  uint64_t Int_bits_checked;
+  uint64_t Int_bit_errors;
+} UDP_shm_live_t;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t size;
+  /** The writer's pid, or 0 once it has exited */
+  int32_t pid;
+  /** Seqlock counter, odd while an update is in progress */
+  uint32_t seq;
+  /** Number of intervals published */
+  uint64_t interval;
+  /** CLOCK_REALTIME nsecs when the interval was published */
+  uint64_t publish_ns;
+  UDPdiag_t stats;
+  UDP_shm_live_t live;
+} UDP_shm_t;
+
+UDP_shm_t *UDP_shm_create(const char *name);
+void UDP_shm_destroy(UDP_shm_t *shm, const char *name);
+const UDP_shm_t *UDP_shm_attach(const char *name);
+bool UDP_shm_writer_alive(const UDP_shm_t *shm);
+
+/** Attempts UDP_shm_read() makes before giving up */
+#define UDP_SHM_READ_TRIES 10000
+
+/** Updates to the segment are bracketed by these two calls */
+static inline void UDP_shm_begin(UDP_shm_t *shm) {
+  __atomic_store_n(&shm->seq, shm->seq+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void UDP_shm_end(UDP_shm_t *shm) {
+  __atomic_store_n(&shm->seq, shm->seq+1, __ATOMIC_RELEASE);
+}
+
+static inline void UDP_shm_publish(UDP_shm_t *shm, const UDPdiag_t *stats,
+                                   uint64_t publish_ns) {
+  UDP_shm_begin(shm);
+  memcpy(&shm->stats, stats, sizeof(UDPdiag_t));
+  ++shm->interval;
+  shm->publish_ns = publish_ns;
+  UDP_shm_end(shm);
+}
+
+/**
+ * Copy a consistent snapshot out of the segment, retrying
+ * if UDPdiag updated it while we were copying.
+ * @return false if no consistent snapshot was obtained in
+ * UDP_SHM_READ_TRIES attempts, as when the writer died in
+ * the middle of an update.
+ */
+static inline bool UDP_shm_read(const UDP_shm_t *shm, UDP_shm_t *snap) {
+  for (int i = 0; i < UDP_SHM_READ_TRIES; ++i) {
+    uint32_t seq1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+    memcpy(snap, shm, sizeof(UDP_shm_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t seq2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    if (!(seq1 & 1) && seq1 == seq2) return true;
+  }
+  return false;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/** @file UDP_timing.cc */
+#include <time.h>
+#include <string.h>
+#include "UDP_timing.h"
+
+#ifdef UDP_STAGE_TIMING
+
+UDP_stage_acc UDP_stages[UDP_N_STAGES];
+
+#ifdef CLOCK_MONOTONIC_RAW
+#define UDP_STAGE_CLOCK_ID CLOCK_MONOTONIC_RAW
+#else
+#define UDP_STAGE_CLOCK_ID CLOCK_MONOTONIC
+#endif
+
+static uint64_t clock_ns() {
+  struct timespec ts;
+  clock_gettime(UDP_STAGE_CLOCK_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if !defined(__x86_64__) && !defined(__i386__)
+uint64_t UDP_stage_clock() {
+  return clock_ns();
+}
+#endif
+
+/** Ticks and nsecs at the last publish, for TSC calibration */
+static uint64_t last_ticks, last_ns;
+
+void UDP_stage_init() {
+  memset(UDP_stages, 0, sizeof(UDP_stages));
+  last_ticks = UDP_stage_clock();
+  last_ns = clock_ns();
+}
+
+/**
+ * Convert the interval's stage statistics to nsecs and reset them.
+ * The tick rate is recalibrated against the system clock over
+ * each interval, which also makes this correct when
+ * UDP_stage_clock() already returns nsecs.
+ */
+void UDP_stage_publish(UDP_Timing_t *timing) {
+  uint64_t ticks = UDP_stage_clock();
+  uint64_t ns = clock_ns();
+  double ns_per_tick = ticks > last_ticks ?
+    (double)(ns - last_ns) / (ticks - last_ticks) : 0;
+  last_ticks = ticks;
+  last_ns = ns;
+  for (int i = 0; i < UDP_N_STAGES; ++i) {
+    UDP_stage_acc *acc = &UDP_stages[i];
+    if (acc->n) {
+      timing->Min_ns[i] = acc->min * ns_per_tick;
+      timing->Mean_ns[i] = acc->sum * ns_per_tick / acc->n;
+      timing->Max_ns[i] = acc->max * ns_per_tick;
+    } else {
+      timing->Min_ns[i] = timing->Mean_ns[i] = timing->Max_ns[i] = 0;
+    }
+    acc->n = 0;
+    acc->sum = acc->min = acc->max = 0;
+  }
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef UDP_TIMING_H_INCLUDED
+#define UDP_TIMING_H_INCLUDED
+#include <stdint.h>
+#include "UDPdiag.h"
+
+/** Hot path stage timing
+ * When compiled with UDP_STAGE_TIMING defined, STAGE_START()
+ * and STAGE_MARK() bracket each stage of the transmit and receive
+ * paths. Each mark costs one TSC read (or CLOCK_MONOTONIC_RAW
+ * where there is no TSC) and a few compares. UDP_stage_publish()
+ * converts the accumulated ticks to nsecs once per interval.
+ * Without UDP_STAGE_TIMING the macros compile to nothing and
+ * UDPdiag.Timing stays zero.
+ */
+#ifdef UDP_STAGE_TIMING
+
+typedef struct {
+  uint32_t n;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+} UDP_stage_acc;
+
+extern UDP_stage_acc UDP_stages[UDP_N_STAGES];
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t UDP_stage_clock() {
+  return __rdtsc();
+}
+#else
+uint64_t UDP_stage_clock();
+#endif
+
+static inline uint64_t UDP_stage_record(int stage, uint64_t start) {
+  uint64_t now = UDP_stage_clock();
+  uint64_t dt = now - start;
+  UDP_stage_acc *acc = &UDP_stages[stage];
+  if (acc->n == 0 || dt < acc->min) acc->min = dt;
+  if (dt > acc->max) acc->max = dt;
+  acc->sum += dt;
+  ++acc->n;
+  return now;
+}
+
+void UDP_stage_init();
+void UDP_stage_publish(UDP_Timing_t *timing);
+
+#define STAGE_START(t) uint64_t t = UDP_stage_clock()
+#define STAGE_MARK(stage, t) (t = UDP_stage_record(stage, t))
+
+#else
+
+#define STAGE_START(t)
+#define STAGE_MARK(stage, t)
+
+#endif
+
+#endif
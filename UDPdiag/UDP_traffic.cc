@@ -0,0 +1,133 @@
+/** @file UDP_traffic.cc */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "UDP_traffic.h"
+#include "nl.h"
+
+const char *trace_file;
+
+UDP_traffic::UDP_traffic(const UDP_traffic_cfg *cfg) : cfg(cfg) {
+  // Fixed seed so runs are repeatable
+  xsubi[0] = 0x330E;
+  xsubi[1] = 0xABCD;
+  xsubi[2] = 0x1234;
+}
+
+UDP_traffic::~UDP_traffic() {}
+
+/**
+ * @return A new traffic model or 0 for CBR or if the model
+ * cannot be started.
+ */
+UDP_traffic *UDP_traffic::new_model(uint16_t model,
+                                    const UDP_traffic_cfg *cfg) {
+  switch (model) {
+    case UDP_TRAFFIC_POISSON:
+      return new UDP_traffic_poisson(cfg);
+    case UDP_TRAFFIC_ONOFF:
+      return new UDP_traffic_onoff(cfg);
+    case UDP_TRAFFIC_TRACE:
+      if (trace_file == 0) {
+        msg(MSG_ERROR, "No trace file specified with -T option");
+      } else {
+        FILE *fp = fopen(trace_file, "r");
+        if (fp == 0) {
+          msg(MSG_ERROR, "Unable to open trace file '%s': %s",
+            trace_file, strerror(errno));
+        } else {
+          return new UDP_traffic_trace(cfg, fp);
+        }
+      }
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+uint16_t UDP_traffic::next_size(uint16_t size) {
+  if (cfg->Size2 && uniform()*100 < cfg->Size2_pct)
+    return cfg->Size2;
+  return size;
+}
+
+double UDP_traffic::uniform() {
+  return erand48(xsubi);
+}
+
+uint64_t UDP_traffic_poisson::next_gap(uint16_t rate) {
+  return (uint64_t)(-log(1.0-uniform()) * 1e9 / rate);
+}
+
+uint64_t UDP_traffic_onoff::next_gap(uint16_t rate) {
+  uint64_t period = cfg->Period_msecs * 1000000ULL;
+  uint64_t on = period * cfg->Duty_pct / 100;
+  if (on == 0) {
+    phase = 0;
+    return period;
+  }
+  uint64_t gap = 1000000000ULL/rate;
+  phase += gap;
+  if (phase >= on) {
+    if (phase < period)
+      gap += period - phase;
+    phase = 0;
+  }
+  return gap;
+}
+
+uint16_t UDP_traffic_onoff::next_size(uint16_t size) {
+  return cfg->Duty_pct ? UDP_traffic::next_size(size) : 0;
+}
+
+UDP_traffic_trace::UDP_traffic_trace(const UDP_traffic_cfg *cfg, FILE *fp)
+    : UDP_traffic(cfg),
+      fp(fp),
+      gap_nsecs(0),
+      size(0)
+{
+  if (!read_line())
+    msg(MSG_ERROR, "Trace file '%s' contains no entries", trace_file);
+}
+
+UDP_traffic_trace::~UDP_traffic_trace() {
+  fclose(fp);
+}
+
+/**
+ * Read the next "<usecs> <size>" entry, skipping blank lines and
+ * comments, and rewinding once at the end of the file.
+ * @return false if no entry could be read
+ */
+bool UDP_traffic_trace::read_line() {
+  char line[80];
+  for (int rewound = 0; rewound < 2; ) {
+    if (fgets(line, sizeof(line), fp) == 0) {
+      rewind(fp);
+      ++rewound;
+      continue;
+    }
+    unsigned long usecs;
+    unsigned sz;
+    if (line[0] == '#' || sscanf(line, "%lu %u", &usecs, &sz) != 2)
+      continue;
+    gap_nsecs = usecs * 1000ULL;
+    size = sz > 0xFFFF ? 0xFFFF : sz;
+    return true;
+  }
+  return false;
+}
+
+uint64_t UDP_traffic_trace::next_gap(uint16_t rate) {
+  if (!read_line()) {
+    // An empty trace falls back to the configured rate
+    size = 0;
+    return 1000000000ULL/rate;
+  }
+  return gap_nsecs;
+}
+
+uint16_t UDP_traffic_trace::next_size(uint16_t size) {
+  return this->size ? this->size : size;
+}
@@ -0,0 +1,102 @@
+#ifndef UDP_TRAFFIC_H_INCLUDED
+#define UDP_TRAFFIC_H_INCLUDED
+#include <stdint.h>
+#include <stdio.h>
+
+/** Traffic model values for the M command */
+#define UDP_TRAFFIC_CBR 0
+#define UDP_TRAFFIC_POISSON 1
+#define UDP_TRAFFIC_ONOFF 2
+#define UDP_TRAFFIC_TRACE 3
+
+/**
+ * Models other than CBR are paced from a fixed timer tick.
+ * Each tick sends every packet whose departure time has passed.
+ */
+#define UDP_TRAFFIC_TICK_NSECS 1000000
+
+extern const char *trace_file;
+
+/** Parameters shared by the traffic models, set by command */
+typedef struct {
+  /** On/off cycle period in msecs */
+  uint16_t Period_msecs;
+  /** Percent of the on/off cycle spent transmitting */
+  uint16_t Duty_pct;
+  /** Alternate packet size for a bimodal distribution, 0 to disable */
+  uint16_t Size2;
+  /** Percent of packets sent at Size2 */
+  uint16_t Size2_pct;
+} UDP_traffic_cfg;
+
+/**
+ * A traffic model decides when each packet departs and how
+ * large it is. The departure process is provided by the
+ * subclass through next_gap(). The base class implements
+ * the constant and bimodal size distributions.
+ */
+class UDP_traffic {
+  public:
+    UDP_traffic(const UDP_traffic_cfg *cfg);
+    virtual ~UDP_traffic();
+    static UDP_traffic *new_model(uint16_t model, const UDP_traffic_cfg *cfg);
+    /**
+     * @param rate The configured packet rate in Hz
+     * @return nsecs from the current departure to the next
+     */
+    virtual uint64_t next_gap(uint16_t rate) = 0;
+    /**
+     * @param size The configured packet size
+     * @return The size of the current packet, or 0 to send
+     * nothing at this departure
+     */
+    virtual uint16_t next_size(uint16_t size);
+  protected:
+    double uniform();
+    const UDP_traffic_cfg *cfg;
+    unsigned short xsubi[3];
+};
+
+/** Exponential inter-arrival times with the configured mean rate */
+class UDP_traffic_poisson : public UDP_traffic {
+  public:
+    inline UDP_traffic_poisson(const UDP_traffic_cfg *cfg) :
+      UDP_traffic(cfg) {}
+    uint64_t next_gap(uint16_t rate);
+};
+
+/**
+ * Constant rate bursts for Duty_pct of each Period_msecs.
+ * With a duty cycle of 0, nothing is sent and the duty cycle
+ * is checked again once per period.
+ */
+class UDP_traffic_onoff : public UDP_traffic {
+  public:
+    inline UDP_traffic_onoff(const UDP_traffic_cfg *cfg) :
+      UDP_traffic(cfg), phase(0) {}
+    uint64_t next_gap(uint16_t rate);
+    uint16_t next_size(uint16_t size);
+  protected:
+    /** nsecs from the start of the current on period */
+    uint64_t phase;
+};
+
+/**
+ * Replays the inter-departure times and sizes from a text file
+ * with one "<usecs> <size>" pair per line, rewinding at the end.
+ * The file is read a line at a time as packets are sent.
+ */
+class UDP_traffic_trace : public UDP_traffic {
+  public:
+    UDP_traffic_trace(const UDP_traffic_cfg *cfg, FILE *fp);
+    ~UDP_traffic_trace();
+    uint64_t next_gap(uint16_t rate);
+    uint16_t next_size(uint16_t size);
+  protected:
+    bool read_line();
+    FILE *fp;
+    uint64_t gap_nsecs;
+    uint16_t size;
+};
+
+#endif
@@ -1,12 +1,14 @@
 /** @file UDPdiag.cc */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "dasio/loop.h"
 #include "dasio/appid.h"
 #include "UDPdiag.h"
@@ -15,6 +17,8 @@
 #include "nl_assert.h"
 #include "oui.h"
 #include "crc16modbus.h"
+#include "prbs31.h"
+#include "UDP_timing.h"
 #include "dasio/tm_data_sndr.h"
 
 DAS_IO::AppID_t DAS_IO::AppID("UDPdiag", "UDP Performance Diagnostic Tool", "V1.0");
@@ -28,12 +32,25 @@ int32_t UDP_interface::get_timestamp() {
   if (clock_gettime(CLOCK_REALTIME, &ts))
     msg(MSG_FATAL, "%s: clock_gettime() returned %d: %s",
       iname, errno, strerror(errno));
-  uint32_t secs_today = (ts.tv_sec % (3600*24));
-  uint32_t msecs = ts.tv_nsec/1000000;
+  return get_timestamp(&ts);
+}
+
+int32_t UDP_interface::get_timestamp(const struct timespec *ts) {
+  uint32_t secs_today = (ts->tv_sec % (3600*24));
+  uint32_t msecs = ts->tv_nsec/1000000;
   return (secs_today*1000)+msecs;
 }
 
+uint64_t UDP_interface::get_monotonic_ns() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    msg(MSG_FATAL, "%s: clock_gettime() returned %d: %s",
+      iname, errno, strerror(errno));
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 UDPdiag_t UDPdiag;
+UDP_shm_t *UDPdiag_shm;
 
 UDP_transmitter::UDP_transmitter(const char *rmt_ip, const char *rmt_port, UDP_tmr *tmr)
       : UDP_interface("UDPtx", 0),
@@ -42,11 +59,35 @@ UDP_transmitter::UDP_transmitter(const char *rmt_ip, const char *rmt_port, UDP_t
         Int_packets_tx(0),
         Int_bytes_tx(0),
         L2R_Transmit_SN(0),
+        L2R_Interval(0),
         L2R_Packet_size(sizeof(UDPdiag_packet)),
         L2R_Packet_rate(0),
+        L2R_Payload_mode(UDP_PAYLOAD_RANDOM),
+        L2R_Traffic_model(UDP_TRAFFIC_CBR),
         L2R_command_len(0),
+        L2R_command_seq((uint16_t)(time(0) ^ getpid())),
+        traffic(0),
+        next_departure(0),
+        next_size(0),
+        mtu_n_sizes(0),
+        mtu_step(0),
+        mtu_interval(0),
+        mtu_fd(-1),
+        mtu_pmtudisc(-1),
+        mtu_saved_size(0),
+        mtu_lo(0),
+        mtu_hi(0),
+        mtu_trial_mtu(0),
+        mtu_trial(0),
+        mtu_trial_sent(0),
+        impair(0),
         tmr(tmr)
 {
+  traffic_cfg.Period_msecs = 1000;
+  traffic_cfg.Duty_pct = 50;
+  traffic_cfg.Size2 = 0;
+  traffic_cfg.Size2_pct = 0;
+
   // Create UDP socket and bind to local tx_port and remote hostname:rx_port
   fd = socket(AF_INET, SOCK_DGRAM, 0);
   if (fd < 0) msg(3, "Unable to create UDP socket: %s", strerror(errno));
@@ -98,21 +139,53 @@ UDP_transmitter::UDP_transmitter(const char *rmt_ip, const char *rmt_port, UDP_t
     msg(MSG_FATAL, "%s: connect returned errno %d: %s",
         iname, errno, strerror(errno));
 
+  // Leave room for a burst of the largest packets
+  int sockbuf = 64 * max_packet_size;
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockbuf, sizeof(sockbuf)))
+    msg(MSG_WARN, "%s: setsockopt(SO_SNDBUF) returned errno %d: %s",
+        iname, errno, strerror(errno));
+
+  // The one transmit buffer is sized for the largest packet,
+  // so changing sizes never reallocates.
   pkt = (UDPdiag_packet*)new_memory(max_packet_size);
   // flags = DAS_IO::Interface::gflag(0);
+  if (impair_spec) {
+    impair = new UDP_impair(impair_spec, max_packet_size);
+    flags |= DAS_IO::Interface::Fl_Timeout;
+  }
   nl_assert(tmr);
   tmr->set_transmitter(this);
 }
 
+UDP_transmitter::~UDP_transmitter() {
+  if (impair) delete impair;
+  if (mtu_fd >= 0) close(mtu_fd);
+}
+
 // Commands:
 //   S:\d+  Set packet size
 //   R:\d+  Set packet rate
+//   P:\d+  Set payload mode (0: random, 1: PRBS-31)
+//   M:\d+  Set traffic model (0: CBR, 1: Poisson, 2: On/off, 3: Trace)
+//   D:\d+  Set on/off duty cycle in percent
+//   B:\d+  Set on/off cycle period in msecs
+//   Z:\d+  Set alternate packet size for bimodal sizes (0 disables)
+//   F:\d+  Set percent of packets sent at the alternate size
+//   U:\d+  Start (1) or abort (0) a path MTU probe
 //   Q      Quit
 //   XS:\d+ Remote Set packet size
 //   XR:\d+ Remote Set packet rate
+//   XP:\d+ Remote Set payload mode
+//   XM:\d+ Remote Set traffic model (and XD, XB, XZ, XF)
+//   XU:\d+ Remote path MTU probe
 //   XQ     Remote Quit
+// A remote command is repeated in every packet until replaced, so
+// it survives packet loss. Command_seq changes with each X command
+// so the remote executes it only once. The initial value differs
+// from run to run so a restarted peer's first command is not
+// mistaken for a repeat.
 bool UDP_transmitter::parse_command(char *cmd, unsigned cmdlen) {
-  if (cmd && cmdlen <= 7) {
+  if (cmd && cmdlen <= sizeof(L2R_command)) {
     buf = (unsigned char *)cmd;
     nc = cmdlen;
     switch (buf[0]) {
@@ -120,8 +193,18 @@ bool UDP_transmitter::parse_command(char *cmd, unsigned cmdlen) {
         if (not_str("S:") || not_uint16(L2R_Packet_size)) {
           report_err("%s: Invalid S command syntax", iname);
           consume(nc);
+        } else if (L2R_Packet_size > max_packet_size) {
+          report_err("%s: Packet size %u exceeds maximum %d", iname,
+            L2R_Packet_size, max_packet_size);
+          L2R_Packet_size = max_packet_size;
+          consume(nc);
         } else {
           report_ok(nc);
+          if (L2R_Packet_size < sizeof(UDPdiag_packet)) {
+            msg(MSG_WARN, "%s: Packet size %u raised to the %d byte header",
+              iname, L2R_Packet_size, (int)sizeof(UDPdiag_packet));
+            L2R_Packet_size = sizeof(UDPdiag_packet);
+          }
         }
         break;
       case 'R':
@@ -130,9 +213,86 @@ bool UDP_transmitter::parse_command(char *cmd, unsigned cmdlen) {
           consume(nc);
         } else {
           report_ok(nc);
-          int per_nsecs = L2R_Packet_rate == 0 ? 0 :
-            (1000000000/(int)L2R_Packet_rate);
-          tmr->settime(per_nsecs);
+          set_timer();
+        }
+        break;
+      case 'P':
+        if (not_str("P:") || not_uint16(L2R_Payload_mode) ||
+            L2R_Payload_mode > UDP_PAYLOAD_PRBS31) {
+          report_err("%s: Invalid P command syntax", iname);
+          L2R_Payload_mode = UDP_PAYLOAD_RANDOM;
+          consume(nc);
+        } else {
+          report_ok(nc);
+        }
+        break;
+      case 'M':
+        {
+          uint16_t model;
+          if (not_str("M:") || not_uint16(model) ||
+              model > UDP_TRAFFIC_TRACE) {
+            report_err("%s: Invalid M command syntax", iname);
+            consume(nc);
+          } else {
+            report_ok(nc);
+            set_traffic_model(model);
+          }
+        }
+        break;
+      case 'D':
+        if (not_str("D:") || not_uint16(traffic_cfg.Duty_pct) ||
+            traffic_cfg.Duty_pct > 100) {
+          report_err("%s: Invalid D command syntax", iname);
+          traffic_cfg.Duty_pct = 50;
+          consume(nc);
+        } else {
+          report_ok(nc);
+        }
+        break;
+      case 'B':
+        if (not_str("B:") || not_uint16(traffic_cfg.Period_msecs) ||
+            traffic_cfg.Period_msecs == 0) {
+          report_err("%s: Invalid B command syntax", iname);
+          traffic_cfg.Period_msecs = 1000;
+          consume(nc);
+        } else {
+          report_ok(nc);
+        }
+        break;
+      case 'Z':
+        if (not_str("Z:") || not_uint16(traffic_cfg.Size2)) {
+          report_err("%s: Invalid Z command syntax", iname);
+          consume(nc);
+        } else {
+          report_ok(nc);
+          if (traffic_cfg.Size2 && traffic_cfg.Size2 < sizeof(UDPdiag_packet))
+            msg(MSG_WARN, "%s: Alternate size %u raised to the %d byte header",
+              iname, traffic_cfg.Size2, (int)sizeof(UDPdiag_packet));
+        }
+        break;
+      case 'F':
+        if (not_str("F:") || not_uint16(traffic_cfg.Size2_pct) ||
+            traffic_cfg.Size2_pct > 100) {
+          report_err("%s: Invalid F command syntax", iname);
+          traffic_cfg.Size2_pct = 0;
+          consume(nc);
+        } else {
+          report_ok(nc);
+        }
+        break;
+      case 'U':
+        {
+          uint16_t start;
+          if (not_str("U:") || not_uint16(start)) {
+            report_err("%s: Invalid U command syntax", iname);
+            consume(nc);
+          } else {
+            report_ok(nc);
+            if (start) mtu_probe_start();
+            else if (UDPdiag.MTU.Probe_state == UDP_MTU_DISCOVER ||
+                     UDPdiag.MTU.Probe_state == UDP_MTU_SWEEP)
+              mtu_probe_stop(UDP_MTU_FAILED);
+          }
         }
         break;
       case 'Q':
@@ -141,63 +301,196 @@ bool UDP_transmitter::parse_command(char *cmd, unsigned cmdlen) {
       case 'X':
         report_ok(nc);
         L2R_command_len = cmdlen-1;
+        ++L2R_command_seq;
         for (int i = 1; i < cmdlen; ++i) {
           L2R_command[i-1] = cmd[i];
         }
         break;
     }
-    return false;
   }
+  return false;
+}
+
+/**
+ * CBR traffic is paced directly by the timer. The other models
+ * schedule their own departures, checked at each timer tick.
+ * A packet rate of zero stops transmission for all models.
+ */
+void UDP_transmitter::set_timer() {
+  int per_nsecs = L2R_Packet_rate == 0 ? 0 :
+    traffic ? UDP_TRAFFIC_TICK_NSECS :
+    (1000000000/(int)L2R_Packet_rate);
+  tmr->settime(per_nsecs);
+}
+
+void UDP_transmitter::set_traffic_model(uint16_t model) {
+  // Restarting the model would restart its schedule and seed
+  if (model == L2R_Traffic_model) return;
+  if (traffic) {
+    delete traffic;
+    traffic = 0;
+  }
+  traffic = UDP_traffic::new_model(model, &traffic_cfg);
+  L2R_Traffic_model = traffic ? model : UDP_TRAFFIC_CBR;
+  next_departure = get_monotonic_ns();
+  next_size = traffic ? traffic->next_size(L2R_Packet_size) : 0;
+  set_timer();
 }
 
 bool UDP_transmitter::transmit(uint16_t n_pkts) {
-  bool rv;
+  if (traffic) return transmit_scheduled();
   for (int i = 0; i < n_pkts; ++i) {
     if (!obuf_empty()) return false;
-    // build the packet
-    // msg(MSG_DBG(0), "Transmit Latencies: N:%d min:%d max:%d",
-      // UDPdiag.R2L.Int_packets_rx, UDPdiag.R2L.Int_min_latency, UDPdiag.R2L.Int_max_latency);
-    pkt->Command_bytes = L2R_command_len;
-    pkt->Packet_size = sizeof(UDPdiag_packet) + L2R_command_len;
-    if (pkt->Packet_size < L2R_Packet_size)
-      pkt->Packet_size = L2R_Packet_size;
-    pkt->Packet_rate = L2R_Packet_rate;
-    pkt->Int_packets_tx = L2R_Int_packets_tx;
-    pkt->Transmit_SN = L2R_Transmit_SN;
-    pkt->Receive_SN = UDPdiag.R2L.Receive_SN;
-    pkt->Int_packets_rx = UDPdiag.R2L.Int_packets_rx;
-    pkt->Int_min_latency = UDPdiag.R2L.Int_min_latency;
-    pkt->Int_mean_latency = UDPdiag.R2L.Int_mean_latency;
-    pkt->Int_max_latency = UDPdiag.R2L.Int_max_latency;
-    pkt->Int_bytes_rx = UDPdiag.R2L.Int_bytes_rx;
-    pkt->Int_bytes_tx = UDPdiag.L2R.Int_bytes_tx;
-    pkt->Total_valid_packets_rx = UDPdiag.R2L.Total_valid_packets_rx;
-    pkt->Total_invalid_packets_rx = UDPdiag.R2L.Total_invalid_packets_rx;
-    
-    int j;
-    for (j = 0; j < L2R_command_len; ++j) {
-      pkt->Remainder[j] = L2R_command[j];
-    }
-    pkt->Transmit_timestamp = get_timestamp();
-    
-    for (; j < pkt->Packet_size - 2; ++j) {
-      pkt->Remainder[j] = (uint8_t)rand();
-    }
-    crc_set();
+    if (send_packet(L2R_Packet_size)) return true;
+  }
+  return false;
+}
+
+/**
+ * Send every packet whose departure time has passed. If we have
+ * fallen more than a second behind, the schedule is restarted
+ * rather than sending the whole backlog at once.
+ */
+bool UDP_transmitter::transmit_scheduled() {
+  uint64_t now = get_monotonic_ns();
+  if (now > next_departure + 1000000000ULL)
+    next_departure = now;
+  while (next_departure <= now) {
+    if (!obuf_empty()) return false;
+    if (next_size && send_packet(next_size)) return true;
+    next_departure += traffic->next_gap(L2R_Packet_rate);
+    next_size = traffic->next_size(L2R_Packet_size);
+  }
+  return false;
+}
+
+bool UDP_transmitter::send_packet(uint16_t size) {
+  bool rv;
+  build_packet(size);
+  STAGE_START(t);
+  if (impair) {
+    impair->submit((uint8_t *)pkt, pkt->Packet_size, get_monotonic_ns());
+    rv = impair_flush();
+  } else {
     rv = iwrite((char *)pkt, pkt->Packet_size);
-    ++L2R_Transmit_SN;
-    ++Int_packets_tx;
-    Int_bytes_tx += pkt->Packet_size;
-    if (rv) return true;
   }
+  STAGE_MARK(UDP_STAGE_TX_WRITE, t);
+  ++L2R_Transmit_SN;
+  ++Int_packets_tx;
+  Int_bytes_tx += pkt->Packet_size;
+  if (UDPdiag_shm) shm_live();
   return rv;
 }
 
+/**
+ * Publish our live counters to shared memory
+ */
+void UDP_transmitter::shm_live() {
+  UDP_shm_begin(UDPdiag_shm);
+  UDP_shm_live_t *live = &UDPdiag_shm->live;
+  live->Interval = L2R_Interval;
+  live->Update_ns = get_monotonic_ns();
+  live->Total_packets_tx = L2R_Transmit_SN;
+  live->Int_packets_tx = Int_packets_tx;
+  live->Int_bytes_tx = Int_bytes_tx;
+  UDP_shm_end(UDPdiag_shm);
+}
+
+/**
+ * Write out any packets held by the impairment shim whose
+ * release time has passed, then set the timeout for the next.
+ */
+bool UDP_transmitter::impair_flush() {
+  uint64_t now = get_monotonic_ns();
+  UDP_impair_slot *slot;
+  while (obuf_empty() && (slot = impair->next_due(now))) {
+    bool rv = iwrite((char *)slot->buf, slot->len);
+    impair->release(slot);
+    if (rv) return true;
+  }
+  int msecs = impair->msecs_until_due(now);
+  if (msecs < 0) {
+    TO.Clear();
+  } else {
+    if (msecs == 0) msecs = 1; // waiting for obuf to drain
+    TO.Set(msecs/1000, msecs%1000);
+  }
+  return false;
+}
+
+bool UDP_transmitter::protocol_timeout() {
+  TO.Clear();
+  return impair ? impair_flush() : false;
+}
+
+void UDP_transmitter::build_packet(uint16_t size) {
+  STAGE_START(t);
+  // build the packet
+  // msg(MSG_DBG(0), "Transmit Latencies: N:%d min:%d max:%d",
+    // UDPdiag.R2L.Int_packets_rx, UDPdiag.R2L.Int_min_latency, UDPdiag.R2L.Int_max_latency);
+  pkt->Command_bytes = L2R_command_len;
+  pkt->Command_seq = L2R_command_seq;
+  pkt->Packet_size = sizeof(UDPdiag_packet) + L2R_command_len;
+  if (pkt->Packet_size < size)
+    pkt->Packet_size = size;
+  // -M leaves room for the header and command, so this never
+  // cuts into them
+  if (pkt->Packet_size > max_packet_size)
+    pkt->Packet_size = max_packet_size;
+  pkt->Packet_rate = L2R_Packet_rate;
+  pkt->Payload_mode = L2R_Payload_mode;
+  pkt->Int_packets_tx = L2R_Int_packets_tx;
+  pkt->Transmit_SN = L2R_Transmit_SN;
+  pkt->Receive_SN = UDPdiag.R2L.Receive_SN;
+  pkt->Int_packets_rx = UDPdiag.R2L.Int_packets_rx;
+  pkt->Int_min_latency = UDPdiag.R2L.Int_min_latency;
+  pkt->Int_mean_latency = UDPdiag.R2L.Int_mean_latency;
+  pkt->Int_max_latency = UDPdiag.R2L.Int_max_latency;
+  pkt->Int_bytes_rx = UDPdiag.R2L.Int_bytes_rx;
+  pkt->Int_bytes_tx = UDPdiag.L2R.Int_bytes_tx;
+  pkt->Total_valid_packets_rx = UDPdiag.R2L.Total_valid_packets_rx;
+  pkt->Total_invalid_packets_rx = UDPdiag.R2L.Total_invalid_packets_rx;
+  pkt->Int_bits_checked = UDPdiag.R2L.Int_bits_checked;
+  pkt->Int_bit_errors = UDPdiag.R2L.Int_bit_errors;
+  pkt->Int_error_bursts = UDPdiag.R2L.Int_error_bursts;
+  pkt->Int_max_burst = UDPdiag.R2L.Int_max_burst;
+  pkt->Int_rx_overhead_mean = UDPdiag.R2L.Int_rx_overhead_mean;
+  pkt->Int_rx_overhead_max = UDPdiag.R2L.Int_rx_overhead_max;
+  for (int j = 0; j < UDP_ERR_HIST_BINS; ++j)
+    pkt->Errored_hist[j] = UDPdiag.R2L.Errored_hist[j];
+  pkt->Tx_interval = L2R_Interval;
+  pkt->Int_interval = L2R_Interval - 1;
+  pkt->Int_timestamp = UDPdiag.L2R.Tx_int_timestamp;
+  pkt->Match_interval = UDPdiag.R2L.Matched_interval;
+  pkt->Match_packets_tx = UDPdiag.R2L.Matched_packets_tx;
+  pkt->Match_packets_rx = UDPdiag.R2L.Matched_packets_rx;
+  pkt->Int_jitter = UDPdiag.R2L.Int_jitter;
+  pkt->Int_iat_min = UDPdiag.R2L.Int_iat_min;
+  pkt->Int_iat_mean = UDPdiag.R2L.Int_iat_mean;
+  pkt->Int_iat_max = UDPdiag.R2L.Int_iat_max;
+  pkt->Int_arrival_rate = UDPdiag.R2L.Int_arrival_rate;
+  for (int j = 0; j < UDP_IAT_HIST_BINS; ++j)
+    pkt->Iat_hist[j] = UDPdiag.R2L.Iat_hist[j];
+  
+  for (int j = 0; j < L2R_command_len; ++j) {
+    pkt->Remainder[j] = L2R_command[j];
+  }
+  pkt->Transmit_timestamp = get_timestamp();
+  pkt->Transmit_usecs = get_monotonic_ns()/1000;
+  STAGE_MARK(UDP_STAGE_TX_HEADER, t);
+  
+  pad_fill();
+  STAGE_MARK(UDP_STAGE_TX_PAD, t);
+  crc_set();
+  STAGE_MARK(UDP_STAGE_TX_CRC, t);
+}
+
 bool UDP_transmitter::tm_sync_too() {
   // msg(MSG_DBG(0), "Trans sync: Int_packets_tx: %d", L2R_Int_packets_tx);
   
   UDPdiag.L2R.Packet_size = L2R_Packet_size;
   UDPdiag.L2R.Packet_rate = L2R_Packet_rate;
+  UDPdiag.L2R.Payload_mode = L2R_Payload_mode;
   L2R_Int_packets_tx = Int_packets_tx;
   L2R_Int_bytes_tx = Int_bytes_tx;
   Int_packets_tx = 0;
@@ -205,9 +498,345 @@ bool UDP_transmitter::tm_sync_too() {
   UDPdiag.L2R.Int_packets_tx = L2R_Int_packets_tx;
   UDPdiag.L2R.Int_bytes_tx = L2R_Int_bytes_tx;
   UDPdiag.L2R.Total_packets_tx = L2R_Transmit_SN;
+  // The receiver closed its R2L interval at the same moment
+  UDPdiag.L2R.Tx_interval = UDPdiag.R2L.Rx_interval = L2R_Interval;
+  UDPdiag.L2R.Tx_int_timestamp = UDPdiag.R2L.Rx_int_timestamp =
+    get_timestamp();
+  ++L2R_Interval;
+  if (UDPdiag.MTU.Probe_state == UDP_MTU_DISCOVER ||
+      UDPdiag.MTU.Probe_state == UDP_MTU_SWEEP)
+    mtu_probe_step();
   return false;
 }
 
+/**
+ * @param sock A connected socket
+ * @return The kernel's current path MTU estimate for the
+ * socket's route, or -1 if it is not available.
+ */
+int UDP_transmitter::get_path_mtu(int sock) {
+#ifdef IP_MTU
+  int mtu;
+  socklen_t len = sizeof(mtu);
+  if (getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len) == 0)
+    return mtu;
+  msg(MSG_ERROR, "%s: getsockopt(IP_MTU) returned errno %d: %s",
+      iname, errno, strerror(errno));
+#endif
+  return -1;
+}
+
+/**
+ * Discovery sends its DF packets on a separate socket connected
+ * to the same peer, so regular traffic on fd never has DF set
+ * and cannot fail with EMSGSIZE.
+ */
+void UDP_transmitter::mtu_probe_start() {
+#ifdef IP_MTU_DISCOVER
+  if (UDPdiag.MTU.Probe_state == UDP_MTU_DISCOVER ||
+      UDPdiag.MTU.Probe_state == UDP_MTU_SWEEP) {
+    msg(MSG_ERROR, "%s: MTU probe already running", iname);
+    return;
+  }
+  if (L2R_Packet_rate == 0) {
+    msg(MSG_ERROR, "%s: MTU probe requires a non-zero packet rate", iname);
+    return;
+  }
+  struct sockaddr_storage peer;
+  socklen_t peerlen = sizeof(peer);
+  int val = IP_PMTUDISC_DO;
+  if (getpeername(fd, (struct sockaddr *)&peer, &peerlen) ||
+      (mtu_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+      setsockopt(mtu_fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) ||
+      connect(mtu_fd, (struct sockaddr *)&peer, peerlen)) {
+    msg(MSG_ERROR, "%s: Unable to set up MTU probe socket: %s",
+        iname, strerror(errno));
+    if (mtu_fd >= 0) {
+      close(mtu_fd);
+      mtu_fd = -1;
+    }
+    return;
+  }
+  memset(&UDPdiag.MTU, 0, sizeof(UDPdiag.MTU));
+  UDPdiag.MTU.Probe_state = UDP_MTU_DISCOVER;
+  mtu_saved_size = L2R_Packet_size;
+  mtu_lo = mtu_min() - 1;
+  mtu_hi = max_packet_size + 28;
+  mtu_trial_mtu = 0;
+  mtu_step = 0;
+  mtu_interval = 0;
+  mtu_matched = UDPdiag.L2R.Matched_interval;
+  msg(MSG, "%s: Starting path MTU probe", iname);
+#else
+  msg(MSG_ERROR, "%s: Path MTU probe not supported", iname);
+#endif
+}
+
+void UDP_transmitter::mtu_probe_stop(uint16_t state) {
+  if (mtu_fd >= 0) {
+    close(mtu_fd);
+    mtu_fd = -1;
+  }
+#ifdef IP_MTU_DISCOVER
+  if (mtu_pmtudisc >= 0) {
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &mtu_pmtudisc,
+      sizeof(mtu_pmtudisc));
+    mtu_pmtudisc = -1;
+  }
+#endif
+  L2R_Packet_size = mtu_saved_size;
+  UDPdiag.MTU.Probe_state = state;
+  UDPdiag.MTU.Probe_size = 0;
+  if (state == UDP_MTU_DONE) {
+    msg(MSG, "%s: Path MTU %u, optimal packet size %u", iname,
+      UDPdiag.MTU.Path_MTU, UDPdiag.MTU.Optimal_size);
+  } else {
+    msg(MSG_WARN, "%s: Path MTU probe aborted", iname);
+  }
+}
+
+/**
+ * Called once per interval while the probe is running.
+ * Discovery searches for the largest DF packet that actually
+ * arrives. Each trial sends mtu_probes DF packets in one
+ * interval and is confirmed when the interval-matched counts
+ * the remote echoes for it lost fewer than half of them. The
+ * kernel's path MTU estimate, lowered by any ICMP
+ * fragmentation-needed replies, bounds the search and is tried
+ * first. If the path silently drops large packets instead, the
+ * trial fails and the search bisects down to the largest size
+ * confirmed. Then DF is cleared and each size in the sweep is
+ * held for mtu_dwell intervals.
+ * Loss is taken from the interval-matched counts the remote
+ * echoes, attributed to the size sent in the matched interval,
+ * so the sweep waits up to mtu_drain intervals at the end for
+ * the last of them. The echoed latencies are not matched, so the
+ * first mtu_settle intervals at each size are discarded for
+ * latency.
+ */
+void UDP_transmitter::mtu_probe_step() {
+  if (UDPdiag.MTU.Probe_state == UDP_MTU_DISCOVER) {
+    int mtu = get_path_mtu(mtu_fd);
+    if (mtu <= 28) {
+      mtu_probe_stop(UDP_MTU_FAILED);
+      return;
+    }
+    if (mtu < mtu_hi) mtu_hi = mtu;
+    if (mtu_trial_mtu) {
+      // Wait for the matched counts of the trial interval
+      bool confirmed = false;
+      if (mtu_trial_sent) {
+        uint32_t matched = UDPdiag.L2R.Matched_interval;
+        if (matched == mtu_matched || matched < mtu_trial) {
+          mtu_matched = matched;
+          if (++mtu_interval >= mtu_drain) {
+            msg(MSG_WARN, "%s: No matched counts received during MTU discovery",
+              iname);
+            mtu_probe_stop(UDP_MTU_FAILED);
+          }
+          return;
+        }
+        if (mtu_matched < mtu_trial) {
+          uint32_t tx = UDPdiag.L2R.Matched_packets_tx;
+          uint32_t rx = UDPdiag.L2R.Matched_packets_rx;
+          uint32_t lost = rx < tx ? tx - rx : 0;
+          confirmed = 2*lost < (uint32_t)mtu_trial_sent;
+        }
+        mtu_matched = matched;
+      }
+      if (confirmed) {
+        mtu_lo = mtu_trial_mtu;
+        UDPdiag.MTU.Path_MTU = mtu_lo;
+      } else {
+        mtu_hi = mtu_trial_mtu - 1;
+      }
+      mtu_trial_mtu = 0;
+    }
+    if (mtu_lo >= mtu_hi) {
+      if (mtu_lo < mtu_min()) {
+        msg(MSG_WARN, "%s: No DF packets delivered during MTU discovery",
+          iname);
+        mtu_probe_stop(UDP_MTU_FAILED);
+      } else {
+        mtu_sweep_start(mtu_lo);
+      }
+      return;
+    }
+    if (!obuf_empty()) return;
+    // The upper bound is usually right, so try it first
+    mtu_trial_mtu = mtu_step++ ? (mtu_lo + mtu_hi + 1)/2 : mtu_hi;
+    mtu_trial = L2R_Interval;
+    mtu_trial_sent = 0;
+    mtu_interval = 0;
+    UDPdiag.MTU.Probe_size = mtu_trial_mtu - 28; // IPv4 and UDP headers
+    for (int k = 0; k < mtu_probes; ++k) {
+      build_packet(UDPdiag.MTU.Probe_size);
+      if (::send(mtu_fd, pkt, pkt->Packet_size, 0) < 0) {
+        // EMSGSIZE when the estimate has dropped below the trial
+        if (errno != EMSGSIZE)
+          msg(MSG_ERROR, "%s: MTU probe send returned errno %d: %s",
+            iname, errno, strerror(errno));
+        break;
+      }
+      ++L2R_Transmit_SN;
+      ++Int_packets_tx;
+      Int_bytes_tx += pkt->Packet_size;
+      ++mtu_trial_sent;
+    }
+    return;
+  }
+
+  // UDP_MTU_SWEEP
+  mtu_collect();
+  if (mtu_step < mtu_n_sizes) {
+    if (++mtu_interval > mtu_settle) {
+      int side = L2R_Packet_size + 28 > UDPdiag.MTU.Path_MTU;
+      uint32_t rx = UDPdiag.L2R.Int_packets_rx;
+      mtu_latency[side] += (int64_t)UDPdiag.L2R.Int_mean_latency * rx;
+      mtu_latency_n[side] += rx;
+    }
+    if (mtu_interval < mtu_dwell) return;
+    mtu_interval = 0;
+    mtu_step_start[++mtu_step] = L2R_Interval;
+    if (mtu_step < mtu_n_sizes) {
+      L2R_Packet_size = mtu_sizes[mtu_step];
+      UDPdiag.MTU.Probe_size = L2R_Packet_size;
+    } else {
+      // Wait for the last intervals to be matched
+      L2R_Packet_size = mtu_saved_size;
+      UDPdiag.MTU.Probe_size = 0;
+    }
+    return;
+  }
+  if (mtu_matched + 1 < mtu_step_start[mtu_n_sizes] &&
+      ++mtu_interval < mtu_drain)
+    return;
+
+  uint64_t tx[2] = { 0, 0 }, rx[2] = { 0, 0 };
+  uint64_t best_goodput = 0;
+  for (int k = 0; k < mtu_n_sizes; ++k) {
+    int side = mtu_sizes[k] + 28 > UDPdiag.MTU.Path_MTU;
+    tx[side] += mtu_step_tx[k];
+    rx[side] += mtu_step_rx[k];
+    if (mtu_step_tx[k]) {
+      // Bytes delivered per thousand packets sent
+      uint64_t goodput = mtu_sizes[k] * mtu_step_rx[k] * 1000 / mtu_step_tx[k];
+      if (goodput > best_goodput) {
+        best_goodput = goodput;
+        UDPdiag.MTU.Optimal_size = mtu_sizes[k];
+      }
+    }
+  }
+  if (tx[0] + tx[1] == 0) {
+    msg(MSG_WARN, "%s: No matched counts received during MTU sweep", iname);
+    mtu_probe_stop(UDP_MTU_FAILED);
+    return;
+  }
+  for (int side = 0; side < 2; ++side) {
+    uint16_t loss = 0;
+    int32_t latency = 0;
+    if (tx[side]) {
+      uint64_t lost = rx[side] < tx[side] ? tx[side] - rx[side] : 0;
+      loss = lost * 10000 / tx[side];
+    }
+    if (mtu_latency_n[side])
+      latency = mtu_latency[side] / (int64_t)mtu_latency_n[side];
+    if (side) {
+      UDPdiag.MTU.Above_loss = loss;
+      UDPdiag.MTU.Above_latency = latency;
+    } else {
+      UDPdiag.MTU.Below_loss = loss;
+      UDPdiag.MTU.Below_latency = latency;
+    }
+  }
+  mtu_probe_stop(UDP_MTU_DONE);
+}
+
+/**
+ * Start the sweep around the confirmed path MTU.
+ */
+void UDP_transmitter::mtu_sweep_start(int path_mtu) {
+  int payload = path_mtu - 28; // IPv4 and UDP headers
+  if (payload > max_packet_size) payload = max_packet_size;
+  int min_size = sizeof(UDPdiag_packet);
+  mtu_n_sizes = 0;
+  for (int k = 1; k <= 4; ++k) {
+    if (payload*k/4 >= min_size)
+      mtu_sizes[mtu_n_sizes++] = payload*k/4;
+  }
+  // Just above multiples of the MTU, spread to fit the
+  // remaining steps, and finally the largest size
+  int n_mult = max_packet_size / payload;
+  int slots = mtu_max_steps - mtu_n_sizes - 1;
+  int stride = (n_mult + slots - 1) / slots;
+  if (stride < 1) stride = 1;
+  for (int k = 1; k <= n_mult; k += stride) {
+    int size = k*payload + 1;
+    if (size >= max_packet_size) break;
+    mtu_sizes[mtu_n_sizes++] = size;
+  }
+  if (mtu_n_sizes == 0 ||
+      mtu_sizes[mtu_n_sizes-1] < max_packet_size)
+    mtu_sizes[mtu_n_sizes++] = max_packet_size;
+  close(mtu_fd);
+  mtu_fd = -1;
+#ifdef IP_MTU_DISCOVER
+  // Let the sweep's large sizes be fragmented
+  socklen_t len = sizeof(mtu_pmtudisc);
+  if (getsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &mtu_pmtudisc, &len))
+    mtu_pmtudisc = -1;
+  int val = IP_PMTUDISC_DONT;
+  setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#endif
+  memset(mtu_step_tx, 0, sizeof(mtu_step_tx));
+  memset(mtu_step_rx, 0, sizeof(mtu_step_rx));
+  memset(mtu_latency, 0, sizeof(mtu_latency));
+  memset(mtu_latency_n, 0, sizeof(mtu_latency_n));
+  mtu_step = 0;
+  mtu_interval = 0;
+  mtu_step_start[0] = L2R_Interval;
+  mtu_matched = UDPdiag.L2R.Matched_interval;
+  UDPdiag.MTU.Path_MTU = path_mtu;
+  L2R_Packet_size = mtu_sizes[0];
+  UDPdiag.MTU.Probe_size = L2R_Packet_size;
+  UDPdiag.MTU.Probe_state = UDP_MTU_SWEEP;
+}
+
+/**
+ * Attribute newly matched L2R counts to the sweep step whose
+ * size was sent during the matched interval.
+ */
+void UDP_transmitter::mtu_collect() {
+  uint32_t matched = UDPdiag.L2R.Matched_interval;
+  if (matched == mtu_matched) return;
+  mtu_matched = matched;
+  for (int k = 0; k <= mtu_step && k < mtu_n_sizes; ++k) {
+    uint32_t end = k < mtu_step ? mtu_step_start[k+1] : L2R_Interval;
+    if (matched >= mtu_step_start[k] && matched < end) {
+      mtu_step_tx[k] += UDPdiag.L2R.Matched_packets_tx;
+      mtu_step_rx[k] += UDPdiag.L2R.Matched_packets_rx;
+      break;
+    }
+  }
+}
+
+/**
+ * Fill the space between the command bytes and the CRC.
+ * The PRBS-31 payload is seeded from the packet's SN so
+ * the receiver can regenerate it to count bit errors.
+ */
+void UDP_transmitter::pad_fill() {
+  int pad_len = pkt->Packet_size - sizeof(UDPdiag_packet) - L2R_command_len;
+  uint8_t *pad = &pkt->Remainder[L2R_command_len];
+  if (L2R_Payload_mode == UDP_PAYLOAD_PRBS31) {
+    prbs31_fill(prbs31_seed(L2R_Transmit_SN), pad, pad_len);
+  } else {
+    for (int j = 0; j < pad_len; ++j) {
+      pad[j] = (uint8_t)rand();
+    }
+  }
+}
+
 void UDP_transmitter::crc_set() {
   uint8_t *data = (uint8_t*)pkt;
   uint16_t crc = crc_calc(data, pkt->Packet_size - 2);
@@ -217,7 +846,7 @@ void UDP_transmitter::crc_set() {
 
 UDP_receiver::UDP_receiver(const char *port, bool allow_remote_commands,
                             UDP_transmitter *tx)
-      : UDP_interface("UDPrx", 10000),
+      : UDP_interface("UDPrx", UDP_MAX_PACKET_SIZE+1),
         recv_port(port),
         allow_remote_commands(allow_remote_commands),
         tx(tx),
@@ -228,8 +857,37 @@ UDP_receiver::UDP_receiver(const char *port, bool allow_remote_commands,
         R2L_Int_min_latency(0),
         R2L_Int_max_latency(0),
         R2L_Int_bytes_rx(0),
-        R2L_latencies(0)
+        R2L_latencies(0),
+        R2L_Int_bits_checked(0),
+        R2L_Int_bit_errors(0),
+        R2L_Int_error_bursts(0),
+        R2L_Int_max_burst(0),
+        R2L_overhead_n(0),
+        R2L_overhead_sum(0),
+        R2L_overhead_max(0),
+        rmt_command_seen(false),
+        rmt_command_seq(0),
+        match_started(false),
+        match_next(0),
+        match_max(0),
+        match_new(false),
+        match_packets_tx(0),
+        match_packets_rx(0),
+        match_interval(0),
+        arrival_started(false),
+        last_arrival_ns(0),
+        last_transit(0),
+        jitter16(0),
+        R2L_iat_n(0),
+        R2L_iat_sum(0),
+        R2L_iat_min(0),
+        R2L_iat_max(0),
+        interval_start_ns(0),
+        busy(0),
+        sock(-1)
 {
+  memset(R2L_Errored_hist, 0, sizeof(R2L_Errored_hist));
+  memset(R2L_Iat_hist, 0, sizeof(R2L_Iat_hist));
   // Create UDP socket and bind to local port
   fd = socket(AF_INET, SOCK_DGRAM, 0);
   if (fd < 0)
@@ -246,13 +904,82 @@ UDP_receiver::UDP_receiver(const char *port, bool allow_remote_commands,
     msg(MSG_FATAL, "%s: bind returned errno %d: %s",
         iname, errno, strerror(errno));
 
+  // -M only limits what we send. Any datagram the peer can send
+  // fits, so a peer with a larger -M is not counted as invalid.
+  int sockbuf = 64 * UDP_MAX_PACKET_SIZE;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockbuf, sizeof(sockbuf)))
+    msg(MSG_WARN, "%s: setsockopt(SO_RCVBUF) returned errno %d: %s",
+        iname, errno, strerror(errno));
+
+  if (busy_poll) {
+#ifdef SO_BUSY_POLL
+    int usecs = 50;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)))
+      msg(MSG_WARN, "%s: setsockopt(SO_BUSY_POLL) returned errno %d: %s",
+          iname, errno, strerror(errno));
+#else
+    msg(MSG_WARN, "%s: SO_BUSY_POLL not supported", iname);
+#endif
+    // The thread owns the socket and the loop watches its pipe
+    busy = new UDP_busy_rx(fd, bufsize, busy_poll_cpu);
+    sock = fd;
+    fd = busy->notify_fd();
+    msg(MSG, "%s: Busy-poll receive on CPU %d", iname, busy_poll_cpu);
+  }
+
   flags = DAS_IO::Interface::Fl_Read | DAS_IO::Interface::gflag(0);
   pkt = (UDPdiag_packet *)buf;
 }
 
+UDP_receiver::~UDP_receiver() {
+  if (busy) {
+    delete busy;
+    close(sock);
+  }
+}
+
 bool UDP_receiver::protocol_input() {
+  if (busy) return busy_receive();
+  bool rv = process_packet(get_timestamp(), get_monotonic_ns());
+  if (UDPdiag_shm) shm_live();
+  return rv;
+}
+
+/**
+ * In busy-poll mode, the bytes read were from the notify pipe.
+ * Process every packet the receive thread has queued, using the
+ * times the thread read them.
+ */
+bool UDP_receiver::busy_receive() {
+  UDP_busy_slot *slot;
+  consume(nc);
+  while ((slot = busy->next())) {
+    memcpy(buf, slot->buf, slot->len);
+    nc = slot->len;
+    cp = 0;
+    buf[nc] = '\0';
+    if (slot->overhead_usecs >= 0) {
+      ++R2L_overhead_n;
+      R2L_overhead_sum += slot->overhead_usecs;
+      if ((uint32_t)slot->overhead_usecs > R2L_overhead_max)
+        R2L_overhead_max = slot->overhead_usecs;
+    }
+    bool rv = process_packet(get_timestamp(&slot->rx_time),
+                             slot->rx_mono_ns);
+    busy->release();
+    if (rv) return true;
+    if (UDPdiag_shm) shm_live();
+  }
+  return false;
+}
+
+/**
+ * @param now msecs since midnight UTC when the packet was read
+ * @param now_ns CLOCK_MONOTONIC nsecs when the packet was read
+ */
+bool UDP_receiver::process_packet(int32_t now, uint64_t now_ns) {
   bool rv = false;
-  int32_t now = get_timestamp();
+  STAGE_START(t);
   
   ++R2L_Total_packets_rx;
   if (nc < sizeof(UDPdiag_packet)) {
@@ -272,13 +999,22 @@ bool UDP_receiver::protocol_input() {
     consume(nc);
     return false;
   }
+  STAGE_MARK(UDP_STAGE_RX_VALIDATE, t);
   if (!crc_ok()) {
     ++R2L_Total_invalid_packets_rx;
+    if (pkt->Payload_mode == UDP_PAYLOAD_PRBS31)
+      prbs_check();
     report_err("%s: CRC error", iname);
     consume(nc);
     return false;
   }
+  STAGE_MARK(UDP_STAGE_RX_CRC, t);
+  if (pkt->Payload_mode == UDP_PAYLOAD_PRBS31) {
+    R2L_Int_bits_checked +=
+      8 * (nc - sizeof(UDPdiag_packet) - pkt->Command_bytes);
+  }
   
+  arrival_stats(now_ns);
   int32_t latency = now - pkt->Transmit_timestamp;
   // msg(MSG_DBG(0), "Latency = %d", latency);
   if (R2L_Int_packets_rx == 0) {
@@ -291,7 +1027,7 @@ bool UDP_receiver::protocol_input() {
   ++R2L_Int_packets_rx;
   ++R2L_Total_valid_packets_rx;
   if (UDPdiag.R2L.Receive_SN > 0 && pkt->Transmit_SN <= UDPdiag.R2L.Receive_SN) {
-    report_err("%s: Rx SN %u <= previous by %u", iname, pkt->Transmit_SN,
+    report_err("%s: Rx SN %" PRIu64 " <= previous by %" PRIu64, iname, pkt->Transmit_SN,
       UDPdiag.R2L.Receive_SN - pkt->Transmit_SN);
   }
   // msg(MSG_DBG(0), "Latency = %d, valid = %u, invalid = %u", latency,
@@ -299,6 +1035,7 @@ bool UDP_receiver::protocol_input() {
       
   UDPdiag.R2L.Packet_size = pkt->Packet_size;
   UDPdiag.R2L.Packet_rate = pkt->Packet_rate;
+  UDPdiag.R2L.Payload_mode = pkt->Payload_mode;
   
   UDPdiag.R2L.Receive_SN = pkt->Transmit_SN;
   UDPdiag.R2L.Total_packets_tx = pkt->Transmit_SN;
@@ -313,9 +1050,36 @@ bool UDP_receiver::protocol_input() {
   UDPdiag.R2L.Int_bytes_tx = pkt->Int_bytes_tx;
   UDPdiag.L2R.Total_valid_packets_rx = pkt->Total_valid_packets_rx;
   UDPdiag.L2R.Total_invalid_packets_rx = pkt->Total_invalid_packets_rx;
+  UDPdiag.L2R.Int_bits_checked = pkt->Int_bits_checked;
+  UDPdiag.L2R.Int_bit_errors = pkt->Int_bit_errors;
+  UDPdiag.L2R.Int_error_bursts = pkt->Int_error_bursts;
+  UDPdiag.L2R.Int_max_burst = pkt->Int_max_burst;
+  UDPdiag.L2R.Int_rx_overhead_mean = pkt->Int_rx_overhead_mean;
+  UDPdiag.L2R.Int_rx_overhead_max = pkt->Int_rx_overhead_max;
+  for (int j = 0; j < UDP_ERR_HIST_BINS; ++j)
+    UDPdiag.L2R.Errored_hist[j] = pkt->Errored_hist[j];
+  UDPdiag.R2L.Tx_interval = UDPdiag.L2R.Rx_interval = pkt->Int_interval;
+  UDPdiag.R2L.Tx_int_timestamp = UDPdiag.L2R.Rx_int_timestamp =
+    pkt->Int_timestamp;
+  UDPdiag.L2R.Matched_interval = pkt->Match_interval;
+  UDPdiag.L2R.Matched_packets_tx = pkt->Match_packets_tx;
+  UDPdiag.L2R.Matched_packets_rx = pkt->Match_packets_rx;
+  UDPdiag.L2R.Int_jitter = pkt->Int_jitter;
+  UDPdiag.L2R.Int_iat_min = pkt->Int_iat_min;
+  UDPdiag.L2R.Int_iat_mean = pkt->Int_iat_mean;
+  UDPdiag.L2R.Int_iat_max = pkt->Int_iat_max;
+  UDPdiag.L2R.Int_arrival_rate = pkt->Int_arrival_rate;
+  for (int j = 0; j < UDP_IAT_HIST_BINS; ++j)
+    UDPdiag.L2R.Iat_hist[j] = pkt->Iat_hist[j];
+  match_record();
+  STAGE_MARK(UDP_STAGE_RX_STATS, t);
   
-  if (pkt->Command_bytes > 0 && allow_remote_commands) {
+  if (pkt->Command_bytes > 0 && allow_remote_commands &&
+      (!rmt_command_seen || pkt->Command_seq != rmt_command_seq)) {
+    rmt_command_seen = true;
+    rmt_command_seq = pkt->Command_seq;
     rv = tx->parse_command((char *)(&pkt->Remainder[0]), pkt->Command_bytes);
+    STAGE_MARK(UDP_STAGE_RX_COMMAND, t);
   }
   report_ok(nc);
   return rv;
@@ -324,22 +1088,195 @@ bool UDP_receiver::protocol_input() {
 bool UDP_receiver::tm_sync() {
   // Update UDPdiag struct with current readings,
   // then clear our interval counters
+  if (busy) busy->report_errors(iname);
   // msg(MSG_DBG(0), "RcvSync Latencies: N:%d min:%d max:%d",
     // R2L_Int_packets_rx, R2L_Int_min_latency, R2L_Int_max_latency);
   UDPdiag.R2L.Int_packets_rx = R2L_Int_packets_rx;
   UDPdiag.R2L.Int_min_latency = R2L_Int_min_latency;
   UDPdiag.R2L.Int_max_latency = R2L_Int_max_latency;
   UDPdiag.R2L.Int_mean_latency = R2L_Int_packets_rx ?
-    R2L_latencies/((int32_t)R2L_Int_packets_rx) : 0;
+    R2L_latencies/((int64_t)R2L_Int_packets_rx) : 0;
   UDPdiag.R2L.Int_bytes_rx = R2L_Int_bytes_rx;
   UDPdiag.R2L.Total_valid_packets_rx = R2L_Total_valid_packets_rx;
   UDPdiag.R2L.Total_invalid_packets_rx = R2L_Total_invalid_packets_rx;
+  UDPdiag.R2L.Int_bits_checked = R2L_Int_bits_checked;
+  UDPdiag.R2L.Int_bit_errors = R2L_Int_bit_errors;
+  UDPdiag.R2L.Int_error_bursts = R2L_Int_error_bursts;
+  UDPdiag.R2L.Int_max_burst = R2L_Int_max_burst;
+  memcpy(UDPdiag.R2L.Errored_hist, R2L_Errored_hist,
+    sizeof(R2L_Errored_hist));
+  UDPdiag.R2L.Int_rx_overhead_mean = R2L_overhead_n ?
+    R2L_overhead_sum/R2L_overhead_n : 0;
+  UDPdiag.R2L.Int_rx_overhead_max = R2L_overhead_max;
+  uint64_t now_ns = get_monotonic_ns();
+  UDPdiag.R2L.Int_arrival_rate =
+    (interval_start_ns && now_ns > interval_start_ns) ?
+    R2L_Int_packets_rx * 100000000000ULL / (now_ns - interval_start_ns) : 0;
+  interval_start_ns = now_ns;
+  UDPdiag.R2L.Int_jitter = jitter16 >> 4;
+  UDPdiag.R2L.Int_iat_min = R2L_iat_min;
+  UDPdiag.R2L.Int_iat_mean = R2L_iat_n ? R2L_iat_sum/R2L_iat_n : 0;
+  UDPdiag.R2L.Int_iat_max = R2L_iat_max;
+  memcpy(UDPdiag.R2L.Iat_hist, R2L_Iat_hist, sizeof(R2L_Iat_hist));
+  R2L_iat_n = 0;
+  R2L_iat_sum = 0;
+  R2L_iat_min = 0;
+  R2L_iat_max = 0;
+  memset(R2L_Iat_hist, 0, sizeof(R2L_Iat_hist));
+  R2L_overhead_n = 0;
+  R2L_overhead_sum = 0;
+  R2L_overhead_max = 0;
   R2L_Int_packets_rx = 0;
   R2L_Int_min_latency = 0;
   R2L_Int_max_latency = 0;
   R2L_latencies = 0;
   R2L_Int_bytes_rx = 0;
-  return tx->tm_sync_too();
+  R2L_Int_bits_checked = 0;
+  R2L_Int_bit_errors = 0;
+  R2L_Int_error_bursts = 0;
+  R2L_Int_max_burst = 0;
+  memset(R2L_Errored_hist, 0, sizeof(R2L_Errored_hist));
+  // Allow packets one interval late before finalizing
+  if (match_started && match_max >= match_next + 2)
+    match_finalize(match_max - 1);
+  if (match_new) {
+    UDPdiag.R2L.Matched_interval = match_interval;
+    UDPdiag.R2L.Matched_packets_tx = match_packets_tx;
+    UDPdiag.R2L.Matched_packets_rx = match_packets_rx;
+    match_packets_tx = match_packets_rx = 0;
+    match_new = false;
+  }
+  bool rv = tx->tm_sync_too();
+#ifdef UDP_STAGE_TIMING
+  UDP_stage_publish(&UDPdiag.Timing);
+#endif
+  if (UDPdiag_shm) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    UDP_shm_publish(UDPdiag_shm, &UDPdiag,
+      ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    // The interval counters have been reset
+    shm_live();
+    tx->shm_live();
+  }
+  return rv;
+}
+
+/**
+ * Publish our live counters to shared memory
+ */
+void UDP_receiver::shm_live() {
+  UDP_shm_begin(UDPdiag_shm);
+  UDP_shm_live_t *live = &UDPdiag_shm->live;
+  live->Interval_start_ns = interval_start_ns;
+  live->Update_ns = get_monotonic_ns();
+  live->Total_valid_packets_rx = R2L_Total_valid_packets_rx;
+  live->Total_invalid_packets_rx = R2L_Total_invalid_packets_rx;
+  live->Receive_SN = UDPdiag.R2L.Receive_SN;
+  live->Int_packets_rx = R2L_Int_packets_rx;
+  live->Int_bytes_rx = R2L_Int_bytes_rx;
+  live->Int_bits_checked = R2L_Int_bits_checked;
+  live->Int_bit_errors = R2L_Int_bit_errors;
+  UDP_shm_end(UDPdiag_shm);
+}
+
+/**
+ * Inter-arrival time and RFC 3550 interarrival jitter of valid
+ * packets. The transit time is arrival minus send time on the
+ * two monotonic clocks, which is meaningless on its own, but
+ * its difference between packets is the jitter sample D(i-1,i).
+ */
+void UDP_receiver::arrival_stats(uint64_t now_ns) {
+  uint32_t transit = (uint32_t)(now_ns/1000) - pkt->Transmit_usecs;
+  if (arrival_started) {
+    uint64_t iat = (now_ns - last_arrival_ns)/1000;
+    if (iat > UINT32_MAX) iat = UINT32_MAX;
+    if (R2L_iat_n == 0 || iat < R2L_iat_min) R2L_iat_min = iat;
+    if (iat > R2L_iat_max) R2L_iat_max = iat;
+    R2L_iat_sum += iat;
+    ++R2L_iat_n;
+    if (pkt->Packet_rate) {
+      // iat/T in millionths
+      uint64_t frac = iat * pkt->Packet_rate;
+      int bin = frac < 500000 ? 0 :
+                frac < 900000 ? 1 :
+                frac < 1100000 ? 2 :
+                frac < 2000000 ? 3 :
+                frac < 4000000 ? 4 : 5;
+      ++R2L_Iat_hist[bin];
+    }
+    int32_t d = (int32_t)(transit - last_transit);
+    if (d < 0) d = -d;
+    jitter16 += d - ((jitter16 + 8) >> 4);
+  }
+  arrival_started = true;
+  last_arrival_ns = now_ns;
+  last_transit = transit;
+}
+
+/**
+ * Count the packet under the sender's interval number and
+ * record the sender's transmit count for its previous interval.
+ */
+void UDP_receiver::match_record() {
+  uint32_t tag = pkt->Tx_interval;
+  if (!match_started || tag + match_ring_size < match_next) {
+    // First packet, or the peer has restarted. Earlier packets
+    // of this interval may have been missed, so start with the next.
+    match_started = true;
+    match_max = tag;
+    match_next = tag + 1;
+    match_packets_tx = match_packets_rx = 0;
+    match_new = false;
+    for (int i = 0; i < match_ring_size; ++i) {
+      // No interval before match_next will be looked up
+      match_ring[i].interval = tag;
+    }
+  }
+  if (tag >= match_next + match_ring_size)
+    match_finalize(tag - match_ring_size + 1);
+  if (tag > match_max) match_max = tag;
+  if (tag >= match_next) {
+    match_rec *rec = &match_ring[tag % match_ring_size];
+    if (rec->interval != tag) {
+      rec->interval = tag;
+      rec->packets_rx = rec->packets_tx = 0;
+      rec->tx_known = false;
+    }
+    ++rec->packets_rx;
+  }
+  uint32_t prev = pkt->Int_interval;
+  if (tag > 0 && prev >= match_next && prev < match_next + match_ring_size) {
+    match_rec *rec = &match_ring[prev % match_ring_size];
+    if (rec->interval != prev) {
+      // Every packet of that interval was lost
+      rec->interval = prev;
+      rec->packets_rx = 0;
+    }
+    rec->packets_tx = pkt->Int_packets_tx;
+    rec->tx_known = true;
+  }
+}
+
+/**
+ * Accumulate the matched counts of intervals before upto and
+ * drop their records. Intervals whose transmit count never
+ * arrived are skipped.
+ */
+void UDP_receiver::match_finalize(uint32_t upto) {
+  uint32_t n = upto - match_next;
+  if (n > match_ring_size) n = match_ring_size;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t interval = match_next + i;
+    match_rec *rec = &match_ring[interval % match_ring_size];
+    if (rec->interval == interval && rec->tx_known) {
+      match_packets_tx += rec->packets_tx;
+      match_packets_rx += rec->packets_rx;
+      match_interval = interval;
+      match_new = true;
+    }
+  }
+  match_next = upto;
 }
 
 bool UDP_receiver::crc_ok() {
@@ -347,6 +1284,37 @@ bool UDP_receiver::crc_ok() {
   return buf[nc-2] == (crc & 0xFF) && buf[nc-1] == ((crc>>8)&0xFF);
 }
 
+/**
+ * Regenerate the PRBS payload of a packet that failed its CRC
+ * and count the flipped bits. If more than a quarter of the
+ * payload bits disagree, the header itself (Transmit_SN or
+ * Command_bytes) was probably hit, so the payload cannot be
+ * aligned and the packet is only counted as a CRC failure.
+ * Its bits are then left out of Int_bits_checked as well, so
+ * the BER is not biased low.
+ */
+void UDP_receiver::prbs_check() {
+  int offset = offsetof(UDPdiag_packet, Remainder) + pkt->Command_bytes;
+  int pad_len = nc - 2 - offset;
+  prbs31_errs_t errs;
+  prbs31_compare(prbs31_seed(pkt->Transmit_SN), &buf[offset], pad_len, &errs);
+  if (errs.bit_errors > 2 * (uint32_t)pad_len)
+    return;
+  R2L_Int_bits_checked += 8 * pad_len;
+  if (errs.bit_errors == 0)
+    return;
+  R2L_Int_bit_errors += errs.bit_errors;
+  R2L_Int_error_bursts += errs.bursts;
+  if (errs.max_burst > R2L_Int_max_burst)
+    R2L_Int_max_burst = errs.max_burst;
+  int bin = errs.bit_errors < 2 ? 0 :
+            errs.bit_errors < 4 ? 1 :
+            errs.bit_errors < 16 ? 2 :
+            errs.bit_errors < 64 ? 3 :
+            errs.bit_errors < 256 ? 4 : 5;
+  ++R2L_Errored_hist[bin];
+}
+
 UDP_cmd::UDP_cmd(UDP_transmitter *tx)
     : DAS_IO::Client("cmd", 40, "cmd", "UDPdiag"),
       tx(tx) {}
@@ -375,6 +1343,10 @@ bool UDP_tmr::protocol_input() {
 
 bool allow_remote_commands = false;
 const char *remote_ip, *rx_port, *tx_port;
+const char *shm_name;
+int max_packet_size = 8000;
+bool busy_poll = false;
+int busy_poll_cpu = -1;
 
 void UDPdiag_init_options(int argc, char **argv) {
   int optltr;
@@ -387,6 +1359,22 @@ void UDPdiag_init_options(int argc, char **argv) {
       case 'r': rx_port = optarg; break;
       case 't': tx_port = optarg; break;
       case 'i': remote_ip = optarg; break;
+      case 'T': trace_file = optarg; break;
+      case 'I': impair_spec = optarg; break;
+      case 'm': shm_name = optarg; break;
+      case 'M':
+        max_packet_size = atoi(optarg);
+        if (max_packet_size <
+              (int)sizeof(UDPdiag_packet) + UDP_MAX_COMMAND_BYTES ||
+            max_packet_size > UDP_MAX_PACKET_SIZE)
+          msg(MSG_FATAL, "Maximum packet size must be between %d and %d",
+            (int)sizeof(UDPdiag_packet) + UDP_MAX_COMMAND_BYTES,
+            UDP_MAX_PACKET_SIZE);
+        break;
+      case 'b':
+        busy_poll = true;
+        busy_poll_cpu = atoi(optarg);
+        break;
       case '?':
         msg(3, "Unrecognized Option -%c", optopt);
       default:
@@ -401,8 +1389,33 @@ void UDPdiag_init_options(int argc, char **argv) {
     msg(MSG_FATAL, "Must specify remote port with -t option");
 }
 
+/**
+ * Unlink the shared memory segment however we exit, so a
+ * later instance does not find it still claimed.
+ */
+static void UDPdiag_shm_cleanup() {
+  if (UDPdiag_shm) {
+    UDP_shm_destroy(UDPdiag_shm, shm_name);
+    UDPdiag_shm = 0;
+  }
+}
+
 int main(int argc, char **argv) {
   oui_init_options(argc, argv);
+  if (shm_name) {
+    UDPdiag_shm = UDP_shm_create(shm_name);
+    if (UDPdiag_shm == 0) {
+      if (errno == EBUSY)
+        msg(MSG_FATAL, "Shared memory '%s' is in use by another UDPdiag",
+          shm_name);
+      msg(MSG_FATAL, "Unable to create shared memory '%s': %s",
+        shm_name, strerror(errno));
+    }
+    atexit(UDPdiag_shm_cleanup);
+  }
+#ifdef UDP_STAGE_TIMING
+  UDP_stage_init();
+#endif
   DAS_IO::Loop ELoop;
   UDP_tmr *tmr = new UDP_tmr();
   ELoop.add_child(tmr);
@@ -14,40 +14,159 @@
  *
  * Since any transmission involves both interfaces, both
  * L2R and R2L will include both local and remote data. The
- * data that is local for one is remote for the other. This
- * means it is difficult to directly overlay the local and
- * remote data. For example, the Int_packets_tx records the
- * number of packets transmitted during the current interval
- * (second) and Int_packets_rx records the number of packets
- * received. In the L2R case, Int_packets_tx is reported at
- * the end of the interval. If the system clocks and telemetry
- * are in perfect sync, then the intervals would agree, but
- * the remote data will then be sent from R2L and only logged
- * with telemetry at the following interval.
+ * data that is local for one is remote for the other, and
+ * each end closes its intervals on its own clock, so the
+ * Int_ statistics of the two ends cover different intervals
+ * and the remote ones are logged at least one interval late.
+ * They should not be overlaid directly.
+ *
+ * To relate them, each end numbers its intervals. Tx_interval
+ * and Tx_int_timestamp identify the transmitting end's interval
+ * for the Int_ transmit statistics (and the msecs since
+ * midnight utc at which it ended), and Rx_interval and
+ * Rx_int_timestamp do the same for the receiving end's Int_
+ * receive statistics.
+ *
+ * For exact loss, every packet is tagged with the sender's
+ * interval number. The receiver counts packets by tag, and
+ * once the sender has reported how many it sent in that
+ * interval and packets from two intervals later have arrived,
+ * it reports the pair as Matched_packets_tx and
+ * Matched_packets_rx for Matched_interval, the transmitting
+ * end's interval number. If more than one interval was matched
+ * since the last report, the counts cover all intervals after
+ * the previously reported Matched_interval. Intervals in which
+ * no packets carrying the transmit count arrived are skipped.
  *
  * Note that Total packets transmitted is current Transmit_SN.
  * When this pertains to the Remote site, Transmit_SN of course
  * will be the Transmit_SN in the lastest packet received.
+ *
+ * Serial numbers, totals and byte and bit counts are kept as
+ * 64-bit values internally and on the wire so they do not wrap
+ * during long high-rate runs. The totals, serial numbers and
+ * interval bit counts are telemetered in full as two 32-bit
+ * words, and the display recombines them.
+ *
+ * The bit error statistics are only accumulated when the
+ * transmitter is sending a PRBS payload (Payload_mode 1).
+ * Int_bits_checked counts payload bits in packets that passed
+ * their CRC and in failed packets whose payload could still be
+ * aligned with the PRBS, and Int_bit_errors, Int_error_bursts
+ * and Int_max_burst describe the packets that failed their CRC.
+ * Errored_hist is the distribution of those packets by number
+ * of flipped bits: 1, 2-3, 4-15, 16-63, 64-255 and 256 or more.
+ *
+ * Int_rx_overhead_mean and _max are only measured when the
+ * receiver runs in busy-poll mode (-b). They are the time in
+ * usecs from the kernel's receive timestamp until the receive
+ * thread read the packet. The latencies and arrival statistics
+ * in that mode use the time the thread read the packet, so
+ * they do not include the event loop's wakeup latency.
+ *
+ * Unlike the latencies, the arrival statistics do not depend
+ * on the two clocks agreeing. The receiver times valid packets
+ * on its own monotonic clock and the sender's monotonic send
+ * time is only used in differences. Int_jitter is the RFC 3550
+ * interarrival jitter estimate in usecs at the end of the
+ * interval. Int_iat_min, _mean and _max are the inter-arrival
+ * times in usecs, and Iat_hist distributes them relative to
+ * the period T advertised by Packet_rate: below 0.5T, 0.5-0.9T,
+ * 0.9-1.1T, 1.1-2T, 2-4T and 4T or more. Int_arrival_rate is
+ * the measured packet rate over the interval in units of
+ * 0.01 Hz, for comparison with Packet_rate.
  */
+#define UDP_ERR_HIST_BINS 6
+#define UDP_IAT_HIST_BINS 6
+
 typedef struct __attribute__((packed)) {
   uint16_t Packet_size;
   uint16_t Packet_rate;
+  uint16_t Payload_mode;
   uint32_t Int_packets_tx;
-  uint32_t Int_bytes_tx;
-  uint32_t Total_packets_tx;
+  uint64_t Int_bytes_tx;
+  uint64_t Total_packets_tx;
 	uint32_t Int_packets_rx;
 	 int32_t Int_min_latency;
 	 int32_t Int_mean_latency;
 	 int32_t Int_max_latency;
-  uint32_t Int_bytes_rx;
-	uint32_t Total_valid_packets_rx;
-	uint32_t Total_invalid_packets_rx;
-	uint32_t Receive_SN;
+  uint64_t Int_bytes_rx;
+	uint64_t Total_valid_packets_rx;
+	uint64_t Total_invalid_packets_rx;
+	uint64_t Receive_SN;
+  uint64_t Int_bits_checked;
+  uint64_t Int_bit_errors;
+  uint32_t Int_error_bursts;
+  uint32_t Int_max_burst;
+  uint32_t Errored_hist[UDP_ERR_HIST_BINS];
+  uint32_t Int_rx_overhead_mean;
+  uint32_t Int_rx_overhead_max;
+  uint32_t Tx_interval;
+   int32_t Tx_int_timestamp;
+  uint32_t Rx_interval;
+   int32_t Rx_int_timestamp;
+  uint32_t Matched_interval;
+  uint32_t Matched_packets_tx;
+  uint32_t Matched_packets_rx;
+  uint32_t Int_jitter;
+  uint32_t Int_iat_min;
+  uint32_t Int_iat_mean;
+  uint32_t Int_iat_max;
+  uint32_t Int_arrival_rate;
+  uint32_t Iat_hist[UDP_IAT_HIST_BINS];
 } UDP_Stats_t;
 
+/** Path MTU probe results
+ * The probe first finds the path MTU as the largest DF packet
+ * confirmed to arrive by the matched counts, so paths that drop
+ * ICMP are measured too. It then sweeps the L2R packet size
+ * across sizes below and above it with DF clear.
+ * Loss is in units of 0.01% and latency is the mean in msecs,
+ * each accumulated separately for the sizes that fit in the path
+ * MTU and those that must be fragmented. Optimal_size is the
+ * size that delivered the most bytes.
+ */
+#define UDP_MTU_IDLE 0
+#define UDP_MTU_DISCOVER 1
+#define UDP_MTU_SWEEP 2
+#define UDP_MTU_DONE 3
+#define UDP_MTU_FAILED 4
+
+typedef struct __attribute__((packed)) {
+  uint16_t Probe_state;
+  uint16_t Probe_size;
+  uint16_t Path_MTU;
+  uint16_t Optimal_size;
+  uint16_t Below_loss;
+  uint16_t Above_loss;
+   int32_t Below_latency;
+   int32_t Above_latency;
+} UDP_MTU_t;
+
+/** Hot path stage timing, in nsecs over the last interval
+ * Only measured when UDPdiag is built with UDP_STAGE_TIMING.
+ */
+#define UDP_STAGE_TX_HEADER 0
+#define UDP_STAGE_TX_PAD 1
+#define UDP_STAGE_TX_CRC 2
+#define UDP_STAGE_TX_WRITE 3
+#define UDP_STAGE_RX_VALIDATE 4
+#define UDP_STAGE_RX_CRC 5
+#define UDP_STAGE_RX_STATS 6
+#define UDP_STAGE_RX_COMMAND 7
+#define UDP_N_STAGES 8
+
+typedef struct __attribute__((packed)) {
+  uint32_t Min_ns[UDP_N_STAGES];
+  uint32_t Mean_ns[UDP_N_STAGES];
+  uint32_t Max_ns[UDP_N_STAGES];
+} UDP_Timing_t;
+
 typedef struct __attribute__((packed)) {
   UDP_Stats_t L2R;
   UDP_Stats_t R2L;
+  UDP_MTU_t MTU;
+  UDP_Timing_t Timing;
 } UDPdiag_t;
 
 extern UDPdiag_t UDPdiag;
@@ -0,0 +1,102 @@
+/** @file UDPshm.cc
+ * Print UDPdiag statistics from its shared memory segment.
+ *   UDPshm [-m name] [-i msecs] [-n count] [-a] [-l]
+ * By default a line is printed each time a new interval is
+ * published. With -a a line is printed at every poll. With -l
+ * the live counters for the interval in progress are printed
+ * at every poll instead. UDPshm exits when the UDPdiag writing
+ * the segment has exited.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include "UDP_shm.h"
+
+static void print_stats(const char *dir, const UDP_Stats_t *s) {
+  printf("  %s tx %8u rx %8u lat %6d/%6d/%6d ms valid %10" PRIu64
+    " invalid %8" PRIu64 " biterr %8" PRIu64 "/%" PRIu64,
+    dir, s->Int_packets_tx, s->Int_packets_rx, s->Int_min_latency,
+    s->Int_mean_latency, s->Int_max_latency, s->Total_valid_packets_rx,
+    s->Total_invalid_packets_rx, s->Int_bit_errors, s->Int_bits_checked);
+}
+
+static void print_live(const UDP_shm_live_t *l) {
+  printf("%u +%6.3lf tx %8u/%10" PRIu64 " rx %8u valid %10" PRIu64
+    " invalid %8" PRIu64 " rxsn %10" PRIu64 " biterr %8" PRIu64 "/%" PRIu64 "\n",
+    l->Interval, (l->Update_ns - l->Interval_start_ns)/1e9,
+    l->Int_packets_tx, l->Total_packets_tx, l->Int_packets_rx,
+    l->Total_valid_packets_rx, l->Total_invalid_packets_rx,
+    l->Receive_SN, l->Int_bit_errors, l->Int_bits_checked);
+}
+
+int main(int argc, char **argv) {
+  const char *name = UDP_SHM_DEFAULT_NAME;
+  int msecs = 1000;
+  long count = 0;
+  bool all = false;
+  bool live = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:i:n:al")) != -1) {
+    switch (opt) {
+      case 'm': name = optarg; break;
+      case 'i': msecs = atoi(optarg); break;
+      case 'n': count = atol(optarg); break;
+      case 'a': all = true; break;
+      case 'l': live = true; break;
+      default:
+        fprintf(stderr,
+          "Usage: %s [-m name] [-i msecs] [-n count] [-a] [-l]\n", argv[0]);
+        return 1;
+    }
+  }
+  const UDP_shm_t *shm = UDP_shm_attach(name);
+  if (shm == 0) {
+    if (errno == EPROTO)
+      fprintf(stderr, "%s: segment '%s' is not UDPdiag version %d\n",
+        argv[0], name, UDP_SHM_VERSION);
+    else fprintf(stderr, "%s: unable to attach to '%s': %s\n",
+        argv[0], name, strerror(errno));
+    return 1;
+  }
+
+  UDP_shm_t snap;
+  uint64_t last_interval = 0;
+  struct timespec delay;
+  delay.tv_sec = msecs/1000;
+  delay.tv_nsec = (msecs%1000) * 1000000L;
+  for (long n = 0; count == 0 || n < count; ) {
+    if (!UDP_shm_writer_alive(shm)) {
+      fprintf(stderr, "%s: UDPdiag writing '%s' has exited\n",
+        argv[0], name);
+      return 1;
+    }
+    if (!UDP_shm_read(shm, &snap)) {
+      // The writer died mid-update, or is updating too often
+      // for us to get a snapshot. Find out which next poll.
+      nanosleep(&delay, 0);
+      continue;
+    }
+    if (live) {
+      print_live(&snap.live);
+      fflush(stdout);
+      ++n;
+    } else if (all || snap.interval != last_interval) {
+      last_interval = snap.interval;
+      printf("%" PRIu64 " %" PRIu64 ".%03u", snap.interval,
+        snap.publish_ns/1000000000,
+        (unsigned)((snap.publish_ns/1000000)%1000));
+      print_stats("L2R", &snap.stats.L2R);
+      print_stats("R2L", &snap.stats.R2L);
+      printf("\n");
+      fflush(stdout);
+      ++n;
+    }
+    nanosleep(&delay, 0);
+  }
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "prbs31.h"
+
+// The generator state holds the last 31 bits of the sequence, most
+// recent in bit 0. Since o[n] = o[n-31] ^ o[n-28], the next 8 bits
+// can be computed in parallel from bits 30..23 and 27..20.
+static inline uint8_t prbs31_byte(uint32_t *state) {
+  uint32_t s = *state;
+  uint8_t byte = ((s >> 23) ^ (s >> 20)) & 0xFF;
+  *state = ((s << 8) | byte) & 0x7FFFFFFF;
+  return byte;
+}
+
+uint32_t prbs31_seed(uint64_t sn) {
+  uint32_t s = ((uint32_t)(sn ^ (sn >> 32)) * 2654435761u) ^ 0x2545F491;
+  s &= 0x7FFFFFFF;
+  return s ? s : 1;
+}
+
+uint32_t prbs31_fill(uint32_t state, void *mem, size_t len) {
+  uint8_t *data = mem;
+  while (len--)
+    *data++ = prbs31_byte(&state);
+  return state;
+}
+
+// Record the errored bits in diff, where bit 63 corresponds to
+// bit position base in the payload.
+static void prbs31_record(uint64_t diff, uint32_t base,
+          prbs31_errs_t *errs, uint32_t *first, uint32_t *last) {
+  while (diff) {
+    int lz = __builtin_clzll(diff);
+    uint32_t pos = base + lz;
+    if (errs->bit_errors == 0 || pos - *last > PRBS31_BURST_GAP) {
+      ++errs->bursts;
+      *first = pos;
+    }
+    *last = pos;
+    if (*last - *first + 1 > errs->max_burst)
+      errs->max_burst = *last - *first + 1;
+    ++errs->bit_errors;
+    diff &= ~(1ULL << (63-lz));
+  }
+}
+
+// The comparison is done 64 bits at a time so error-free words,
+// which are the common case even on a poor link, cost one XOR
+// and one test.
+void prbs31_compare(uint32_t state, void const *mem, size_t len,
+                    prbs31_errs_t *errs) {
+  uint8_t const *data = mem;
+  uint32_t first = 0, last = 0;
+  uint32_t base = 0;
+  errs->bit_errors = 0;
+  errs->bursts = 0;
+  errs->max_burst = 0;
+  while (len) {
+    uint64_t diff = 0;
+    int n = len < 8 ? len : 8;
+    for (int i = 0; i < n; ++i)
+      diff = (diff << 8) | (uint8_t)(*data++ ^ prbs31_byte(&state));
+    if (n < 8) diff <<= 8*(8-n);
+    if (diff) prbs31_record(diff, base, errs, &first, &last);
+    base += 64;
+    len -= n;
+  }
+}
@@ -0,0 +1,36 @@
+// The PRBS-31 routines generate and check the ITU-T O.150 pseudo-random
+// bit sequence x^31 + x^28 + 1. Bits are packed into bytes most
+// significant bit first. prbs31_seed() derives a non-zero generator
+// state from a packet serial number so the receiver can regenerate
+// any packet's payload independently of the packets around it.
+// prbs31_fill() writes len bytes of the sequence to mem and returns
+// the updated state. prbs31_compare() regenerates len bytes from state
+// and compares them against mem, accumulating the number of flipped
+// bits and the error bursts into errs.
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Errored bits that are no more than PRBS31_BURST_GAP bits apart
+// are counted as part of the same burst.
+#define PRBS31_BURST_GAP 16
+
+typedef struct {
+  uint32_t bit_errors;
+  uint32_t bursts;
+  uint32_t max_burst; // bits from first to last error in a burst
+} prbs31_errs_t;
+
+uint32_t prbs31_seed(uint64_t sn);
+
+uint32_t prbs31_fill(uint32_t state, void *mem, size_t len);
+
+void prbs31_compare(uint32_t state, void const *mem, size_t len,
+                    prbs31_errs_t *errs);
+
+#ifdef __cplusplus
+}
+#endif